@@ -1,4 +1,5 @@
 #include "elfio/elfio.hpp"
+#include <charconv>
 #include <libcharm/arm.hpp>
 #include <libcharm/emulator.hpp>
 #include <libcharm/recomp.hpp>
@@ -7,6 +8,8 @@ const std::string VERSION = "0.01.00";
 const std::string RECOMP = "recomp";
 const std::string DUMP = "dump";
 const std::string MINIFY = "--minify";
+const std::string SHARDS = "--shards";
+const std::string EMBED_DATA = "--embed-data";
 
 void show_help();
 void dump(const std::string &elf_exe, const std::string &dump_file);
@@ -21,15 +24,29 @@ int main(int argc, char **argv) {
   }
 
   bool minify = false;
+  size_t shards = 1;
+  bool embed_data = false;
   for (int i = 0; i < argc; i++) {
     if (argv[i] == MINIFY) {
       minify = true;
-      break;
+    } else if (argv[i] == SHARDS && i + 1 < argc) {
+      const std::string value = argv[++i];
+      auto result = std::from_chars(value.data(), value.data() + value.size(),
+                                    shards);
+
+      if (result.ec != std::errc{} ||
+          result.ptr != value.data() + value.size() || !shards) {
+        show_help();
+        return 1;
+      }
+    } else if (argv[i] == EMBED_DATA) {
+      embed_data = true;
     }
   }
 
   if (argv[1] == RECOMP) {
-    charm::recomp::Recompiler recomp{argv[2], minify};
+    charm::recomp::Recompiler recomp{argv[2], minify, shards,
+                                      embed_data};
     recomp.emit(argv[3]);
   } else if (argv[1] == DUMP) {
     dump(argv[2], argv[3]);
@@ -69,11 +86,16 @@ void show_help() {
       << "Optional Arguments:\n"
       << "\t--minify\tMinimize the produced C++ code to reduce compilation "
          "time. The output might be harder to read.\n"
+      << "\t--shards N\tSplit recompiled functions into N source files, "
+         "so they can be compiled in parallel (make -j).\n"
+      << "\t--embed-data\tWrite data sections into .bin files, included "
+         "with #embed or .incbin instead of C++ initializers.\n"
       << std::endl;
 
   std::cout << "Examples:\n"
             << "\tcharm-cli recomp libfmath.so out/ --minify\n"
             << "\tcharm-cli recomp libfoo.so build/\n"
+            << "\tcharm-cli recomp libfoo.so build/ --shards 8\n"
             << "\tcharm-cli dump libfoo.so dump.txt\n";
 }
 
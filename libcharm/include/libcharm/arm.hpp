@@ -206,6 +206,11 @@ public:
   static Instruction decode(instr_t instr);
   void dump(std::ostream &str);
 
+  bool reads(Register reg) const;
+  bool reads_pc() const;
+  bool writes_pc() const;
+  bool is_return() const;
+
 private:
   void decode_data_processing(instr_t instr);
   void decode_multiply(instr_t instr);
@@ -2,8 +2,12 @@
 #include "libcharm/arm.hpp"
 #include <cstdint>
 #include <elfio/elfio.hpp>
+#include <map>
+#include <set>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace charm::recomp {
 
@@ -11,11 +15,32 @@ struct Function {
   std::string name;
   arm::addr_t address;
   bool is_external;
+  arm::addr_t end = 0; /* End of the function (guest functions only) */
 };
 
+struct JumpTable {
+  arm::Register index;              /* Register holding the case index */
+  std::vector<arm::addr_t> targets; /* Where each case jumps to */
+};
+
+struct Frame {
+  std::map<arm::addr_t, int32_t> entries; /* SP offset at leaders, if not 0 */
+  std::set<int32_t> slots; /* Spill slots, as offsets from SP at entry */
+};
+
+struct Constant {
+  arm::Register rd; /* Register that the instruction sets */
+  uint32_t value;   /* Value known at recompile time */
+};
+
+std::string symbol_name_map(const std::string &symbol);
+bool section_is_data(const ELFIO::section *section);
+bool section_is_code(const ELFIO::section *section);
+
 class Recompiler {
 public:
-  Recompiler(const std::string &elf_exe, bool minify = false);
+  Recompiler(const std::string &elf_exe, bool minify = false,
+             size_t shards = 1, bool embed_data = false);
   void emit(const std::string &output_dir);
 
 private:
@@ -26,18 +51,44 @@ private:
   void analyze_reloc_dyn();
   void analyze_exported_functions();
   void analyze_map_plt_to_reloc();
+  void analyze_functions();
+  void analyze_leaders();
+  void analyze_jump_tables();
+  void analyze_data();
+  void analyze_flags();
+  void analyze_constants();
+  void analyze_frames();
+
+  const ELFIO::section *code_section(arm::addr_t address);
+  const ELFIO::section *section_at(arm::addr_t address);
+  bool read_word(arm::addr_t address, uint32_t &value);
+  bool read_constant(arm::addr_t address, uint32_t &value);
+  arm::addr_t branch_target(const arm::Instruction &instr,
+                            arm::addr_t address, Function *&mapped);
 
   void emit_makefile(const std::string &output_dir);
+  void emit_sources(const std::string &output_dir);
   void emit_code_source(const std::string &output_dir);
   void emit_code_header(const std::string &output_dir);
   void emit_data_header(const std::string &output_dir);
   void emit_data_source(const std::string &output_dir);
+  void emit_data_blob(std::ostream &ofs, const std::string &output_dir,
+                      const ELFIO::section *section);
 
-  void emit_code_address_mappings(std::ofstream &ofs);
-  void emit_code_stubs(std::ofstream &ofs);
-  void emit_code_section(std::ofstream &ofs, const ELFIO::section *section);
+  std::vector<arm::addr_t> shard_bounds();
+  std::string shard_name(size_t index);
+  void emit_code_prelude(std::ostream &ofs, bool impl);
+  void emit_code_address_mappings(std::ostream &ofs);
+  void emit_code_stubs(std::ostream &ofs);
+  void emit_code_dispatcher(std::ostream &ofs);
+  void emit_code_section(std::ostream &ofs, const ELFIO::section *section,
+                         arm::addr_t begin, arm::addr_t end);
+  void emit_code_function(std::ostream &os, const ELFIO::section *section,
+                          const Function &fun);
+  bool has_label(arm::addr_t address, const Function &fun);
+  std::string code_flags(const arm::Instruction &instr, arm::addr_t address);
   void emit_code_arm(std::ostream &os, const arm::Instruction &instr,
-                     arm::addr_t address);
+                     arm::addr_t address, const Function &fun);
 
   template <typename... Args>
   void emit_code_invalid(std::ostream &os, const arm::Instruction &instr,
@@ -45,18 +96,29 @@ private:
     char buffer[512] = {0};
     snprintf(buffer, 512, fmt, args...);
 
-    os << std::hex << "throw std::runtime_error(\"" << buffer << " (addr = 0x"
+    os << std::hex << "liblayer_fault(\"" << buffer << " (addr = 0x"
        << address << ", raw=0x" << instr.raw << ")\")";
   }
 
   bool _minify;
+  size_t _shards; /* Number of code_NNN.cpp files, 1 keeps all in code.cpp */
+  bool _embed_data; /* Data sections are included from .bin files */
   ELFIO::elfio _elf;
-  ELFIO::section *_text, *_plt, *_relplt, *_reldyn, *_dynsym;
+  ELFIO::section *_text, *_plt, *_relplt, *_reldyn, *_dynsym, *_symtab;
 
   std::vector<std::tuple<arm::addr_t, arm::addr_t>> _got_mappings;
   std::unordered_map<arm::addr_t, Function> _funs_deps;
   std::unordered_map<arm::addr_t, Function> _funs_exports;
   std::unordered_map<arm::addr_t, Function *> _fun_deps_mapped;
+  std::map<arm::addr_t, Function> _funs_guest;
+  std::unordered_set<arm::addr_t> _leaders;
+  std::unordered_map<arm::addr_t, uint8_t> _flags_live;
+  std::unordered_map<arm::addr_t, JumpTable> _jump_tables;
+  std::unordered_set<arm::addr_t> _data_words;
+  std::unordered_map<arm::addr_t, Constant> _constants;
+  std::unordered_map<arm::addr_t, Frame> _frames;
+  std::unordered_map<arm::addr_t, int32_t> _slot_accesses;
+  std::unordered_set<arm::addr_t> _tail_calls;
 };
 
 } // namespace charm::recomp
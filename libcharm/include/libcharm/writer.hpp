@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <ostream>
+#include <streambuf>
+#include <vector>
+
+namespace charm::recomp {
+
+// Output buffer for generated files. Text is collected in a large buffer that
+// is written to the file in big chunks, flushing (e.g. std::endl) doesn't
+// reach the file. With `minify`, line breaks and tabs are dropped as the text
+// is written, except for the ones that end preprocessor directives. Write
+// errors throw, close() reports the ones of the last chunk.
+class WriterBuffer : public std::streambuf {
+public:
+  WriterBuffer(const std::filesystem::path &path, bool minify);
+  ~WriterBuffer() override;
+
+  void close();
+
+protected:
+  int_type overflow(int_type ch) override;
+  std::streamsize xsputn(const char *s, std::streamsize n) override;
+  int sync() override;
+
+private:
+  void put(char c);
+  void put_raw(char c);
+  void flush_buffer();
+
+  std::filesystem::path _path;
+  std::ofstream _file;
+  std::vector<char> _buffer;
+  size_t _used = 0;
+  bool _minify;
+  bool _line_start = true;     /* Input is at the start of a line */
+  bool _directive = false;     /* Input is in a preprocessor directive */
+  bool _out_line_start = true; /* Output is at the start of a line */
+};
+
+// Generated file, written through WriterBuffer. Errors are rethrown instead
+// of only setting badbit, the file has to be closed explicitly to see all of
+// them.
+class Writer : public std::ostream {
+public:
+  Writer(const std::filesystem::path &path, bool minify = false);
+
+  void close();
+
+private:
+  WriterBuffer _buffer;
+};
+
+// Integer formatting for hot paths that doesn't go trough locales,
+// `os << Hex{value}` writes the same as `os << std::hex << value << std::dec`.
+struct Hex {
+  uint32_t value;
+};
+
+struct Dec {
+  uint64_t value;
+};
+
+std::ostream &operator<<(std::ostream &os, Hex hex);
+std::ostream &operator<<(std::ostream &os, Dec dec);
+
+} // namespace charm::recomp
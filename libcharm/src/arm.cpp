@@ -314,6 +314,116 @@ inline void Instruction::decode_shift(instr_t instr, Shifter &shift) {
       static_cast<Register>(get_bits<0, 4>(instr)); /* Rm register, bits 0-3 */
 }
 
+// Returns true if instruction uses PC as an operand, such as PC-relative loads,
+// `mov rX, pc`, `str pc` or a shifter operand using PC.
+bool Instruction::reads_pc() const { return reads(Register::PC); }
+
+// Returns true if instruction uses the register as an operand, including
+// base registers of memory accesses and stored registers.
+bool Instruction::reads(Register reg) const {
+  auto uses = [&](Register operand) { return operand == reg; };
+  auto shifter_uses = [&](const Shifter &shifter) {
+    return uses(shifter.rm) ||
+           (shifter.is_reg && shifter.amount_or_rs == (int)reg);
+  };
+
+  switch (group) {
+  case InstructionGroup::DATA_PROCESSING:
+    // MOV and MVN don't have Rn
+    if (data.op != Opcode::MOV && data.op != Opcode::MVN && uses(data.rn)) {
+      return true;
+    }
+
+    return !is_imm && shifter_uses(data.op2_reg);
+
+  case InstructionGroup::MULTIPLY:
+    return uses(mul.rs) || uses(mul.rm) ||
+           (mul.accumulate && uses(mul.rn));
+
+  case InstructionGroup::MULTIPLY_LONG:
+    return uses(mul_long.rs) || uses(mul_long.rm);
+
+  case InstructionGroup::SINGLE_DATA_SWAP:
+    return uses(data_swap.rn) || uses(data_swap.rm);
+
+  case InstructionGroup::SINGLE_DATA_TRANSFER:
+    return uses(data_trans.rn) ||
+           (!data_trans.load && uses(data_trans.rd)) ||
+           (!is_imm && shifter_uses(data_trans.offset_reg));
+
+  case InstructionGroup::HALFWORD_DATA_TRANSFER:
+    return uses(hw_data_trans.rn) ||
+           (!hw_data_trans.load && uses(hw_data_trans.rd)) ||
+           (!is_imm && uses(hw_data_trans.rm));
+
+  case InstructionGroup::BLOCK_DATA_TRANSFER:
+    return uses(blk_data_trans.rn) ||
+           (!blk_data_trans.load &&
+            ((blk_data_trans.reg_list >> (int)reg) & 1));
+
+  case InstructionGroup::BRANCH_EXCHANGE:
+    return uses(branchex.rm);
+
+  default:
+    return false;
+  }
+}
+
+// Whether instruction (possibly) changes the control flow by writing PC.
+bool Instruction::writes_pc() const {
+  switch (group) {
+  case InstructionGroup::DATA_PROCESSING:
+    if (data.rd != Register::PC) {
+      return false;
+    }
+
+    // these instructions don't write rd
+    return data.op != Opcode::TST && data.op != Opcode::TEQ &&
+           data.op != Opcode::CMP && data.op != Opcode::CMN;
+
+  case InstructionGroup::SINGLE_DATA_TRANSFER:
+    return data_trans.load && data_trans.rd == Register::PC;
+
+  case InstructionGroup::BLOCK_DATA_TRANSFER:
+    return blk_data_trans.load &&
+           ((blk_data_trans.reg_list >> (int)Register::PC) & 1);
+
+  case InstructionGroup::BRANCH:
+  case InstructionGroup::BRANCH_EXCHANGE:
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+// Matches common function return idioms: `bx lr`, `mov pc, lr`,
+// `ldr pc, [sp], #4`, `ldm sp!, {..., pc}` and `ldmea fp, {..., sp, pc}`.
+bool Instruction::is_return() const {
+  switch (group) {
+  case InstructionGroup::DATA_PROCESSING:
+    return data.op == Opcode::MOV && data.rd == Register::PC && !is_imm &&
+           !data.op2_reg.is_reg && data.op2_reg.type == ShifterType::LSL &&
+           data.op2_reg.amount_or_rs == 0 && data.op2_reg.rm == Register::LR;
+
+  case InstructionGroup::SINGLE_DATA_TRANSFER:
+    return writes_pc() && data_trans.rn == Register::SP &&
+           !data_trans.pre_indx;
+
+  case InstructionGroup::BLOCK_DATA_TRANSFER:
+    return writes_pc() &&
+           (blk_data_trans.rn == Register::SP ||
+            (blk_data_trans.rn == Register::R11 &&
+             ((blk_data_trans.reg_list >> (int)Register::SP) & 1)));
+
+  case InstructionGroup::BRANCH_EXCHANGE:
+    return branchex.rm == Register::LR;
+
+  default:
+    return false;
+  }
+}
+
 void Instruction::dump(std::ostream &ofs) {
   ofs << "(" << COND_TABLE[(int)cond] << ") ";
 
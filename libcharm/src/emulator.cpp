@@ -18,6 +18,10 @@ namespace charm {
 reg_value_t shift(EmulationState &ps, charm::arm::Shifter shifter);
 
 inline uint32_t EmulationState::address_map(uintptr_t addr) {
+  if (uint32_t mapped = pages.lookup(addr)) {
+    return mapped;
+  }
+
   for (auto &section : _elf->sections) {
     if (addr < reinterpret_cast<uintptr_t>(section->get_data()) ||
         addr >= reinterpret_cast<uintptr_t>(section->get_data()) +
@@ -37,6 +41,10 @@ inline uint32_t EmulationState::address_map(uintptr_t addr) {
 }
 
 inline uintptr_t EmulationState::address_resolve(uint32_t addr) {
+  if (uintptr_t mapped = pages.resolve(addr)) {
+    return mapped;
+  }
+
   for (auto &section : _elf->sections) {
     if (addr < static_cast<uint32_t>(section->get_address()) ||
         addr >= static_cast<uint32_t>(section->get_address()) +
@@ -62,6 +70,16 @@ inline uintptr_t EmulationState::address_resolve(uint32_t addr) {
 
 Emulator::Emulator(ELFIO::elfio *elf, arm::addr_t address) {
   ps._elf = elf;
+
+  // sections without data are left for address_resolve to report
+  for (auto &section : elf->sections) {
+    if (section->get_data() && section->get_address()) {
+      ps.pages.map(static_cast<uint32_t>(section->get_address()),
+                   static_cast<uint32_t>(section->get_size()),
+                   section->get_data());
+    }
+  }
+
   set_address(address);
 }
 
@@ -92,11 +110,11 @@ bool Emulator::step(arm::Instruction &instr) {
 
   case arm::InstructionGroup::MULTIPLY:
     if (instr.mul.accumulate) {
-      ps.arm_mla(instr.set_cond, (reg_idx_t)instr.mul.rd,
+      ps.arm_mla(instr.set_cond ? FLAGS_ALL : 0, (reg_idx_t)instr.mul.rd,
                  (reg_idx_t)instr.mul.rn, (reg_idx_t)instr.mul.rs,
                  (reg_idx_t)instr.mul.rm);
     } else {
-      ps.arm_mul(instr.set_cond, (reg_idx_t)instr.mul.rd,
+      ps.arm_mul(instr.set_cond ? FLAGS_ALL : 0, (reg_idx_t)instr.mul.rd,
                  (reg_idx_t)instr.mul.rn, (reg_idx_t)instr.mul.rs,
                  (reg_idx_t)instr.mul.rm);
     }
@@ -208,100 +226,102 @@ inline bool Emulator::arm_check_cond(const arm::Instruction &instr) {
 
 /* This function handles data-processing ARM instructions. */
 inline void Emulator::arm_data_processing(const arm::Instruction &instr) {
+  const uint8_t flags = instr.set_cond ? FLAGS_ALL : 0;
+
   switch (instr.data.op) {
   case arm::Opcode::AND:
     ps.arm_and(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::EOR:
     ps.arm_eor(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::SUB:
     ps.arm_sub(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::RSB:
     ps.arm_rsb(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::ADD:
     ps.arm_add(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::ADC:
     ps.arm_adc(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::SBC:
     ps.arm_sbc(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::RSC:
     ps.arm_rsc(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::TST:
     ps.arm_tst(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::TEQ:
     ps.arm_teq(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::CMP:
     ps.arm_cmp(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::CMN:
     ps.arm_cmn(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::ORR:
     ps.arm_orr(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::MOV:
     ps.arm_mov(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::BIC:
     ps.arm_bic(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
   case arm::Opcode::MVN:
     ps.arm_mvn(
-        instr.set_cond, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
+        flags, (reg_idx_t)instr.data.rd, (reg_idx_t)instr.data.rn,
         instr.is_imm ? instr.data.op2_imm : shift(ps, instr.data.op2_reg));
     break;
 
@@ -1,10 +1,13 @@
 #include "libcharm/recomp.hpp"
+#include <algorithm>
 #include <chrono>
+#include <filesystem>
 #include <stdexcept>
 
 namespace charm::recomp {
 
-Recompiler::Recompiler(const std::string &elf_exe, bool minify) {
+Recompiler::Recompiler(const std::string &elf_exe, bool minify,
+                       size_t shards, bool embed_data) {
   if (!_elf.load(elf_exe))
     throw std::runtime_error("Not an elf file!");
 
@@ -39,7 +42,10 @@ Recompiler::Recompiler(const std::string &elf_exe, bool minify) {
     _reldyn = _elf.sections[".rela.dyn"];
 
   _dynsym = _elf.sections[".dynsym"];
+  _symtab = _elf.sections[".symtab"];
   _minify = minify;
+  _shards = shards;
+  _embed_data = embed_data;
 }
 
 void Recompiler::emit(const std::string &output_dir) {
@@ -47,6 +53,10 @@ void Recompiler::emit(const std::string &output_dir) {
   auto start = std::chrono::high_resolution_clock::now();
   step_analyze();
 
+  // a shard needs at least one function
+  _shards = std::clamp<size_t>(_shards, 1,
+                               std::max<size_t>(_funs_guest.size(), 1));
+
   std::cout << "Finished in "
             << std::chrono::duration_cast<std::chrono::milliseconds>(
                    (std::chrono::high_resolution_clock::now() - start))
@@ -54,12 +64,28 @@ void Recompiler::emit(const std::string &output_dir) {
             << " ms." << std::endl;
 
   std::cout << "********   EMIT  ********" << std::endl;
-  start = std::chrono::high_resolution_clock::now();
+  const auto analyzed = std::chrono::high_resolution_clock::now();
   step_emit(output_dir);
 
-  std::cout << "Finished in "
-            << std::chrono::duration_cast<std::chrono::milliseconds>(
-                   (std::chrono::high_resolution_clock::now() - start))
+  const auto now = std::chrono::high_resolution_clock::now();
+  const auto emit_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(now - analyzed)
+          .count();
+
+  // generated files, without following the liblayer symlink
+  uintmax_t size = 0;
+  for (auto &entry : std::filesystem::directory_iterator{output_dir}) {
+    if (entry.is_regular_file() && !entry.is_symlink()) {
+      size += entry.file_size();
+    }
+  }
+
+  std::cout << "Finished in " << emit_ms << " ms, emitted " << size / 1024
+            << " KB (" << size * 1000 / 1048576 / std::max<int64_t>(emit_ms, 1)
+            << " MB/s)." << std::endl;
+  std::cout << "Total "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(now -
+                                                                     start)
                    .count()
             << " ms." << std::endl;
 }
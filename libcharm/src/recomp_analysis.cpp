@@ -1,10 +1,18 @@
 #include "libcharm/arm.hpp"
 #include "libcharm/emulator.hpp"
 #include "libcharm/recomp.hpp"
+#include <algorithm>
+#include <cstring>
 #include <exception>
+#include <map>
+#include <optional>
+#include <set>
 #include <ostream>
 #include <sstream>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace charm::recomp {
 
@@ -18,6 +26,13 @@ void Recompiler::step_analyze() {
   }
 
   analyze_exported_functions();
+  analyze_functions();
+  analyze_leaders();
+  analyze_jump_tables();
+  analyze_data();
+  analyze_flags();
+  analyze_constants();
+  analyze_frames();
 }
 
 // This step iterates trough .GOT table in the ELF binary and collects
@@ -213,4 +228,1338 @@ void Recompiler::analyze_map_plt_to_reloc() {
   std::cout << "\tMapped " << _fun_deps_mapped.size() << " ranges!"
             << std::endl;
 }
+
+// This step splits code sections into guest functions, so that each one can be
+// emitted as a separate C++ function. Entry points are collected from exported
+// and internal functions, symbol tables, the ELF entry point and every BL
+// target. A function then spans until the next entry point or the end of its
+// section.
+void Recompiler::analyze_functions() {
+  std::cout << "> Discovering functions ..." << std::endl;
+
+  std::map<arm::addr_t, std::string> entries;
+  auto add_entry = [&](arm::addr_t address, const std::string &name) {
+    // unaligned addresses are thumb, which we don't support (yet)
+    const auto *section = code_section(address);
+    if (address & 3 || !section ||
+        address + sizeof(arm::instr_t) >
+            section->get_address() + section->get_size()) {
+      return;
+    }
+
+    auto &entry = entries[address];
+    if (entry.empty()) {
+      entry = name;
+    }
+  };
+
+  for (auto &function : _funs_exports) {
+    add_entry(function.first, function.second.name);
+  }
+
+  for (auto &function : _funs_deps) {
+    if (!function.second.is_external) {
+      add_entry(function.second.address, function.second.name);
+    }
+  }
+
+  for (auto *section : {_symtab, _dynsym}) {
+    if (!section) {
+      continue;
+    }
+
+    ELFIO::symbol_section_accessor symbols(_elf, section);
+
+    for (ELFIO::Elf_Xword i = 0; i < symbols.get_symbols_num(); i++) {
+      std::string name;
+      ELFIO::Elf64_Addr value;
+      ELFIO::Elf_Xword size;
+      unsigned char bind, type_sym, other;
+      ELFIO::Elf_Half shndx;
+
+      if (!symbols.get_symbol(i, name, value, size, bind, type_sym, shndx,
+                              other)) {
+        continue;
+      }
+
+      if (type_sym != ELFIO::STT_FUNC || shndx == ELFIO::SHN_UNDEF) {
+        continue;
+      }
+
+      add_entry(static_cast<arm::addr_t>(value), name);
+    }
+  }
+
+  add_entry(static_cast<arm::addr_t>(_elf.get_entry()), "_start");
+
+  for (auto &section : _elf.sections) {
+    if (!section_is_code(section.get())) {
+      continue;
+    }
+
+    const auto data = section->get_data();
+    const auto base = static_cast<arm::addr_t>(section->get_address());
+
+    // anything before the first entry point still has to belong somewhere
+    add_entry(base, "");
+
+    for (arm::addr_t i = 0; i + sizeof(arm::instr_t) <= section->get_size();
+         i += sizeof(arm::instr_t)) {
+      arm::instr_t instr_raw;
+      memcpy(&instr_raw, data + i, sizeof(arm::instr_t));
+      auto instr = arm::Instruction::decode(instr_raw);
+
+      if (instr.group != arm::InstructionGroup::BRANCH || !instr.branch.link) {
+        continue;
+      }
+
+      Function *mapped = nullptr;
+      arm::addr_t target = branch_target(instr, base + i, mapped);
+
+      if (mapped && mapped->is_external) {
+        continue;
+      }
+
+      add_entry(target, "");
+    }
+  }
+
+  for (auto it = entries.begin(); it != entries.end(); it++) {
+    const auto *section = code_section(it->first);
+
+    // a trailing partial word isn't an instruction
+    arm::addr_t end = (section->get_address() + section->get_size()) &
+                      ~static_cast<arm::addr_t>(sizeof(arm::instr_t) - 1);
+
+    auto next = std::next(it);
+    if (next != entries.end() && next->first < end) {
+      end = next->first;
+    }
+
+    std::string name = it->second;
+    if (name.empty()) {
+      std::stringstream ss;
+      ss << "sub_" << std::hex << it->first;
+      name = ss.str();
+    }
+
+    _funs_guest[it->first] = Function{
+        .name = name,
+        .address = it->first,
+        .is_external = false,
+        .end = end,
+    };
+  }
+
+  std::cout << "\tFound " << _funs_guest.size() << " functions!" << std::endl;
+}
+
+// Registers that the instruction may write, calls clobber everything.
+static uint16_t regs_written(const arm::Instruction &instr) {
+  switch (instr.group) {
+  case arm::InstructionGroup::DATA_PROCESSING:
+    switch (instr.data.op) {
+    case arm::Opcode::TST:
+    case arm::Opcode::TEQ:
+    case arm::Opcode::CMP:
+    case arm::Opcode::CMN:
+      return 0;
+    default:
+      return 1 << (int)instr.data.rd;
+    }
+
+  case arm::InstructionGroup::MULTIPLY:
+    return 1 << (int)instr.mul.rd;
+
+  case arm::InstructionGroup::MULTIPLY_LONG:
+    return (1 << (int)instr.mul_long.rd_lo) | (1 << (int)instr.mul_long.rd_hi);
+
+  case arm::InstructionGroup::SINGLE_DATA_SWAP:
+    return 1 << (int)instr.data_swap.rd;
+
+  case arm::InstructionGroup::SINGLE_DATA_TRANSFER:
+    return (instr.data_trans.load ? 1 << (int)instr.data_trans.rd : 0) |
+           (instr.data_trans.write_back || !instr.data_trans.pre_indx
+                ? 1 << (int)instr.data_trans.rn
+                : 0);
+
+  case arm::InstructionGroup::HALFWORD_DATA_TRANSFER:
+    return (instr.hw_data_trans.load ? 1 << (int)instr.hw_data_trans.rd : 0) |
+           (instr.hw_data_trans.write_back || !instr.hw_data_trans.pre_indx
+                ? 1 << (int)instr.hw_data_trans.rn
+                : 0);
+
+  case arm::InstructionGroup::BLOCK_DATA_TRANSFER:
+    return (instr.blk_data_trans.load ? instr.blk_data_trans.reg_list : 0) |
+           (instr.blk_data_trans.write_back
+                ? 1 << (int)instr.blk_data_trans.rn
+                : 0);
+
+  case arm::InstructionGroup::BRANCH:
+    return instr.branch.link ? 0xffff : 0;
+
+  case arm::InstructionGroup::BRANCH_EXCHANGE:
+    return 0;
+
+  default:
+    return 0xffff;
+  }
+}
+
+// This step finds basic block leaders: instructions that control can reach
+// from somewhere else than the previous instruction. Only leaders get a label
+// in emitted code, everything in between is emitted as straight-line code.
+// Apart from function entries and branch targets, this includes return sites
+// and anything that looks like a code address in the image (function pointers,
+// vtables, jump tables), since those can be jumped to indirectly. Position
+// independent code computes such addresses relative to PC instead, with
+// `add rX, pc, #imm` (adr) or `ldr rY, [pc, #imm]; add rX, pc, rY`.
+void Recompiler::analyze_leaders() {
+  std::cout << "> Finding basic block leaders ..." << std::endl;
+
+  auto add_leader = [&](arm::addr_t address) {
+    if (!(address & 3) && code_section(address)) {
+      _leaders.insert(address);
+    }
+  };
+
+  for (auto &function : _funs_guest) {
+    add_leader(function.first);
+  }
+
+  for (auto &mapping : _got_mappings) {
+    add_leader(std::get<1>(mapping));
+  }
+
+  for (auto &section : _elf.sections) {
+    const auto data = section->get_data();
+    const auto base = static_cast<arm::addr_t>(section->get_address());
+
+    if (!data || !(section->get_flags() & ELFIO::SHF_ALLOC)) {
+      continue;
+    }
+
+    // code pointers stored in data, literal pools or inline jump tables
+    for (arm::addr_t i = 0; i + sizeof(uint32_t) <= section->get_size();
+         i += sizeof(uint32_t)) {
+      uint32_t value;
+      memcpy(&value, data + i, sizeof(uint32_t));
+      add_leader(value);
+    }
+
+    if (!section_is_code(section.get())) {
+      continue;
+    }
+
+    bool branch_table = false;
+
+    // registers holding a literal loaded relative to PC
+    uint16_t literals_known = 0;
+    uint32_t literals[16] = {0};
+
+    for (arm::addr_t i = 0; i + sizeof(arm::instr_t) <= section->get_size();
+         i += sizeof(arm::instr_t)) {
+      arm::addr_t address = base + i;
+
+      arm::instr_t instr_raw;
+      memcpy(&instr_raw, data + i, sizeof(arm::instr_t));
+      auto instr = arm::Instruction::decode(instr_raw);
+
+      const arm::addr_t pc = address + 8;
+      uint32_t literal = 0;
+      bool loads_literal = false;
+
+      if (instr.group == arm::InstructionGroup::DATA_PROCESSING &&
+          instr.data.rn == arm::Register::PC &&
+          instr.data.rd != arm::Register::PC &&
+          (instr.data.op == arm::Opcode::ADD ||
+           instr.data.op == arm::Opcode::SUB)) {
+        const auto &op2 = instr.data.op2_reg;
+        const bool add = instr.data.op == arm::Opcode::ADD;
+
+        if (instr.is_imm) {
+          add_leader(add ? pc + instr.data.op2_imm : pc - instr.data.op2_imm);
+        } else if (add && !op2.is_reg && !op2.amount_or_rs &&
+                   op2.type == arm::ShifterType::LSL &&
+                   ((literals_known >> (int)op2.rm) & 1)) {
+          add_leader(pc + literals[(int)op2.rm]);
+        }
+      } else if (instr.group == arm::InstructionGroup::SINGLE_DATA_TRANSFER &&
+                 instr.data_trans.load && instr.is_imm &&
+                 !instr.data_trans.byte && instr.data_trans.pre_indx &&
+                 !instr.data_trans.write_back &&
+                 instr.data_trans.rn == arm::Register::PC) {
+        loads_literal = read_constant(instr.data_trans.add
+                                          ? pc + instr.data_trans.offset_imm
+                                          : pc - instr.data_trans.offset_imm,
+                                      literal);
+      }
+
+      literals_known &= ~regs_written(instr);
+      if (loads_literal) {
+        literals_known |= 1 << (int)instr.data_trans.rd;
+        literals[(int)instr.data_trans.rd] = literal;
+      }
+
+      bool is_branch = instr.group == arm::InstructionGroup::BRANCH;
+
+      // `add pc, pc, rN, lsl #2` is followed by a table of branches
+      if (branch_table && is_branch && !instr.branch.link) {
+        add_leader(address);
+      } else {
+        branch_table = instr.group == arm::InstructionGroup::DATA_PROCESSING &&
+                       instr.writes_pc() && instr.data.rn == arm::Register::PC;
+      }
+
+      // anything after a jump can be a return site (`mov lr, pc; bx rN`)
+      if (instr.writes_pc()) {
+        add_leader(address + sizeof(arm::instr_t));
+      }
+
+      if (is_branch) {
+        Function *mapped = nullptr;
+        arm::addr_t target = branch_target(instr, address, mapped);
+
+        if (!mapped || !mapped->is_external) {
+          add_leader(target);
+        }
+      }
+    }
+  }
+
+  std::cout << "\tFound " << _leaders.size() << " leaders!" << std::endl;
+}
+
+// This step recognizes jump tables emitted for switch statements:
+//
+//   cmp rN, #K                      cmp rN, #K
+//   addls pc, pc, rN, lsl #2        ldrls pc, [pc, rN, lsl #2]
+//   b default                       b default
+//   b case_0                        .word case_0
+//   ...                             ...
+//
+// The bound check gives the table extent, every case can then be a direct
+// jump. The check itself is optional for correctness, as indices out of range
+// still go trough the original instruction.
+void Recompiler::analyze_jump_tables() {
+  std::cout << "> Recognizing jump tables ..." << std::endl;
+
+  for (auto &function : _funs_guest) {
+    const auto &fun = function.second;
+
+    for (arm::addr_t address = fun.address; address < fun.end;
+         address += sizeof(arm::instr_t)) {
+      arm::instr_t instr_raw;
+      read_word(address, instr_raw);
+      auto instr = arm::Instruction::decode(instr_raw);
+
+      bool is_add = instr.group == arm::InstructionGroup::DATA_PROCESSING &&
+                    instr.data.op == arm::Opcode::ADD && !instr.is_imm &&
+                    instr.data.rd == arm::Register::PC &&
+                    instr.data.rn == arm::Register::PC;
+      bool is_ldr =
+          instr.group == arm::InstructionGroup::SINGLE_DATA_TRANSFER &&
+          instr.data_trans.load && !instr.is_imm && !instr.data_trans.byte &&
+          instr.data_trans.pre_indx && instr.data_trans.add &&
+          !instr.data_trans.write_back &&
+          instr.data_trans.rd == arm::Register::PC &&
+          instr.data_trans.rn == arm::Register::PC;
+
+      if (!is_add && !is_ldr) {
+        continue;
+      }
+
+      const auto &shift =
+          is_add ? instr.data.op2_reg : instr.data_trans.offset_reg;
+      if (shift.is_reg || shift.type != arm::ShifterType::LSL ||
+          shift.amount_or_rs != 2 || shift.rm == arm::Register::PC) {
+        continue;
+      }
+
+      // `cmp rN, #K` right before, or before `bhi default`
+      arm::addr_t cmp_address = address - sizeof(arm::instr_t);
+      arm::instr_t raw;
+
+      if (instr.cond == arm::Condition::AL && read_word(cmp_address, raw)) {
+        auto prev = arm::Instruction::decode(raw);
+        if (prev.group == arm::InstructionGroup::BRANCH &&
+            prev.cond == arm::Condition::HI && !prev.branch.link) {
+          cmp_address -= sizeof(arm::instr_t);
+        }
+      } else if (instr.cond != arm::Condition::LS) {
+        continue;
+      }
+
+      if (cmp_address < fun.address || !read_word(cmp_address, raw)) {
+        continue;
+      }
+
+      auto cmp = arm::Instruction::decode(raw);
+      if (cmp.group != arm::InstructionGroup::DATA_PROCESSING ||
+          cmp.data.op != arm::Opcode::CMP || !cmp.is_imm ||
+          cmp.cond != arm::Condition::AL || cmp.data.rn != shift.rm ||
+          cmp.data.op2_imm > 1024) {
+        continue;
+      }
+
+      // the table is in the code itself, so it can't change
+      JumpTable table{.index = shift.rm};
+      const arm::addr_t base = address + 8;
+
+      for (arm::addr_t i = 0; i <= cmp.data.op2_imm; i++) {
+        arm::addr_t entry = base + i * sizeof(uint32_t);
+        arm::addr_t target = entry;
+
+        const auto *section = section_at(entry);
+        if (!section || (section->get_flags() & ELFIO::SHF_WRITE) ||
+            !read_word(entry, raw)) {
+          table.targets.clear();
+          break;
+        }
+
+        if (is_ldr) {
+          target = raw;
+        } else {
+          // skip the branch if the entry is one
+          auto branch = arm::Instruction::decode(raw);
+          Function *mapped = nullptr;
+
+          if (branch.group == arm::InstructionGroup::BRANCH &&
+              !branch.branch.link && branch.cond == arm::Condition::AL) {
+            arm::addr_t branch_to = branch_target(branch, entry, mapped);
+            if (!mapped || !mapped->is_external) {
+              target = branch_to;
+            }
+          }
+        }
+
+        if ((target & 3) || !code_section(target)) {
+          table.targets.clear();
+          break;
+        }
+
+        table.targets.push_back(target);
+      }
+
+      if (table.targets.empty()) {
+        continue;
+      }
+
+      for (auto target : table.targets) {
+        _leaders.insert(target);
+      }
+
+      _jump_tables[address] = std::move(table);
+    }
+  }
+
+  std::cout << "\tFound " << _jump_tables.size() << " jump tables!"
+            << std::endl;
+}
+
+// Returns the word that a PC-relative load reads, or 0 if the instruction
+// isn't one.
+static arm::addr_t literal_address(const arm::Instruction &instr,
+                                   arm::addr_t address) {
+  uint32_t offset;
+
+  if (instr.group == arm::InstructionGroup::SINGLE_DATA_TRANSFER &&
+      instr.data_trans.load && instr.is_imm && instr.data_trans.pre_indx &&
+      instr.data_trans.rn == arm::Register::PC) {
+    offset = instr.data_trans.offset_imm;
+    return (address + 8 + (instr.data_trans.add ? offset : -offset)) & ~3;
+  }
+
+  if (instr.group == arm::InstructionGroup::HALFWORD_DATA_TRANSFER &&
+      instr.hw_data_trans.load && instr.is_imm &&
+      instr.hw_data_trans.pre_indx &&
+      instr.hw_data_trans.rn == arm::Register::PC) {
+    offset = instr.hw_data_trans.offset_imm;
+    return (address + 8 + (instr.hw_data_trans.add ? offset : -offset)) & ~3;
+  }
+
+  return 0;
+}
+
+// This step finds data embedded in code sections: literal pools, their
+// padding and inline jump tables. Code is whatever is reachable from function
+// entries and leaders, a run of unreachable words is data if code reads any
+// word of it with a PC-relative load. Leaders right after an unconditional
+// jump are only a guess for return sites, so they don't count as entries when
+// a load reads them. Data words are then left out of emitted code.
+void Recompiler::analyze_data() {
+  std::cout << "> Finding data in code sections ..." << std::endl;
+
+  std::unordered_set<arm::addr_t> reachable, loaded;
+  std::set<arm::addr_t> guessed;
+  std::vector<arm::addr_t> work;
+
+  auto visit = [&](arm::addr_t address) {
+    if (!(address & 3) && code_section(address) &&
+        reachable.insert(address).second) {
+      work.push_back(address);
+    }
+  };
+
+  auto propagate = [&]() {
+    while (!work.empty()) {
+      arm::addr_t address = work.back();
+      work.pop_back();
+
+      arm::instr_t instr_raw;
+      read_word(address, instr_raw);
+      auto instr = arm::Instruction::decode(instr_raw);
+
+      if (arm::addr_t literal = literal_address(instr, address)) {
+        loaded.insert(literal);
+      }
+
+      if (_jump_tables.count(address)) {
+        const auto &table = _jump_tables[address];
+
+        for (size_t i = 0; i < table.targets.size(); i++) {
+          // `ldr pc, [pc, rN, lsl #2]` reads the table, the add form runs it
+          if (instr.group == arm::InstructionGroup::SINGLE_DATA_TRANSFER) {
+            loaded.insert(address + 8 + i * sizeof(uint32_t));
+          }
+
+          visit(table.targets[i]);
+        }
+      }
+
+      if (instr.group == arm::InstructionGroup::BRANCH) {
+        Function *mapped = nullptr;
+        arm::addr_t target = branch_target(instr, address, mapped);
+
+        if (!mapped || !mapped->is_external) {
+          visit(target);
+        }
+      }
+
+      // calls return to the next instruction
+      if (!instr.writes_pc() || instr.cond != arm::Condition::AL ||
+          (instr.group == arm::InstructionGroup::BRANCH && instr.branch.link)) {
+        visit(address + sizeof(arm::instr_t));
+      }
+    }
+  };
+
+  for (auto &function : _funs_guest) {
+    visit(function.first);
+  }
+
+  for (auto leader : _leaders) {
+    arm::instr_t raw;
+    if (code_section(leader - sizeof(arm::instr_t)) &&
+        read_word(leader - sizeof(arm::instr_t), raw)) {
+      auto prev = arm::Instruction::decode(raw);
+
+      if (prev.writes_pc() && prev.cond == arm::Condition::AL &&
+          !(prev.group == arm::InstructionGroup::BRANCH && prev.branch.link)) {
+        guessed.insert(leader);
+        continue;
+      }
+    }
+
+    visit(leader);
+  }
+
+  propagate();
+
+  // pools follow the code that reads them, so going in address order lets
+  // that code claim them first
+  for (auto leader : guessed) {
+    if (!loaded.count(leader)) {
+      visit(leader);
+      propagate();
+    }
+  }
+
+  for (auto &section : _elf.sections) {
+    if (!section_is_code(section.get())) {
+      continue;
+    }
+
+    const auto base = static_cast<arm::addr_t>(section->get_address());
+    const auto end = static_cast<arm::addr_t>(base + section->get_size());
+
+    for (arm::addr_t address = base; address < end;) {
+      if (reachable.count(address)) {
+        address += sizeof(arm::instr_t);
+        continue;
+      }
+
+      arm::addr_t run = address;
+      bool is_data = false;
+
+      for (; address < end && !reachable.count(address);
+           address += sizeof(arm::instr_t)) {
+        is_data |= loaded.count(address) > 0;
+      }
+
+      for (; is_data && run < address; run += sizeof(arm::instr_t)) {
+        _data_words.insert(run);
+        _leaders.erase(run);
+      }
+    }
+  }
+
+  std::cout << "\tFound " << _data_words.size() << " data words!"
+            << std::endl;
+}
+
+// Flags that the instruction reads, either trough its condition or as carry in.
+static uint8_t flags_read(const arm::Instruction &instr) {
+  uint8_t flags = 0;
+
+  switch (instr.cond) {
+  case arm::Condition::EQ:
+  case arm::Condition::NE:
+    flags = FLAG_Z;
+    break;
+  case arm::Condition::CS:
+  case arm::Condition::CC:
+    flags = FLAG_C;
+    break;
+  case arm::Condition::MI:
+  case arm::Condition::PL:
+    flags = FLAG_N;
+    break;
+  case arm::Condition::VS:
+  case arm::Condition::VC:
+    flags = FLAG_V;
+    break;
+  case arm::Condition::HI:
+  case arm::Condition::LS:
+    flags = FLAG_C | FLAG_Z;
+    break;
+  case arm::Condition::GE:
+  case arm::Condition::LT:
+    flags = FLAG_N | FLAG_V;
+    break;
+  case arm::Condition::GT:
+  case arm::Condition::LE:
+    flags = FLAG_N | FLAG_Z | FLAG_V;
+    break;
+  default:
+    break;
+  }
+
+  switch (instr.group) {
+  case arm::InstructionGroup::DATA_PROCESSING:
+    if (instr.data.op == arm::Opcode::ADC ||
+        instr.data.op == arm::Opcode::SBC ||
+        instr.data.op == arm::Opcode::RSC) {
+      flags |= FLAG_C;
+    }
+    break;
+
+  case arm::InstructionGroup::SWI:
+    flags |= FLAGS_ALL;
+    break;
+
+  default:
+    break;
+  }
+
+  return flags;
+}
+
+// Flags that liblayer computes for the instruction, logical operations and
+// multiplies only update N and Z.
+static uint8_t flags_written(const arm::Instruction &instr) {
+  if (!instr.set_cond) {
+    return 0;
+  }
+
+  switch (instr.group) {
+  case arm::InstructionGroup::DATA_PROCESSING:
+    switch (instr.data.op) {
+    case arm::Opcode::ADD:
+    case arm::Opcode::ADC:
+    case arm::Opcode::SUB:
+    case arm::Opcode::SBC:
+    case arm::Opcode::RSB:
+    case arm::Opcode::RSC:
+    case arm::Opcode::CMP:
+    case arm::Opcode::CMN:
+      return FLAGS_ALL;
+    default:
+      return FLAG_N | FLAG_Z;
+    }
+
+  case arm::InstructionGroup::MULTIPLY:
+  case arm::InstructionGroup::MULTIPLY_LONG:
+    return FLAG_N | FLAG_Z;
+
+  default:
+    return 0;
+  }
+}
+
+// This step is a backward liveness analysis of NZCV flags within each guest
+// function. Flag-setting instructions then compute only the flags that some
+// later instruction can read. Calls don't preserve flags (AAPCS), so BL kills
+// all of them, and returns keep them live only for functions whose callers
+// read flags after the call (e.g. `__aeabi_cfcmple`). Anything else that
+// leaves the function keeps all flags live.
+void Recompiler::analyze_flags() {
+  std::cout << "> Analyzing flag liveness ..." << std::endl;
+
+  struct Liveness {
+    std::vector<arm::Instruction> instrs;
+    std::vector<uint8_t> live_in, live_out;
+  };
+
+  std::unordered_map<arm::addr_t, Liveness> functions;
+  std::unordered_set<arm::addr_t> returns_flags;
+  bool returns_flags_all = false;
+
+  for (auto &function : _funs_guest) {
+    const auto &fun = function.second;
+    const auto *section = code_section(fun.address);
+    const auto data =
+        section->get_data() + (fun.address - section->get_address());
+
+    auto &liveness = functions[fun.address];
+    const size_t count = (fun.end - fun.address) / sizeof(arm::instr_t);
+
+    for (size_t i = 0; i < count; i++) {
+      arm::instr_t instr_raw;
+      memcpy(&instr_raw, data + i * sizeof(arm::instr_t),
+             sizeof(arm::instr_t));
+      liveness.instrs.push_back(arm::Instruction::decode(instr_raw));
+    }
+  }
+
+  // returns depend on callers, so repeat until no new function returns flags
+  for (bool changed = true; changed;) {
+    changed = false;
+
+    auto mark = [&](arm::addr_t address) {
+      auto it = _funs_guest.upper_bound(address);
+      if (it == _funs_guest.begin()) {
+        return;
+      }
+
+      it--;
+      if (address < it->second.end && returns_flags.insert(it->first).second) {
+        changed = true;
+      }
+    };
+
+    for (auto &function : _funs_guest) {
+      const auto &fun = function.second;
+      auto &liveness = functions[fun.address];
+      const auto &instrs = liveness.instrs;
+      const size_t count = instrs.size();
+      const bool returns =
+          returns_flags_all || returns_flags.count(fun.address);
+
+      liveness.live_in.assign(count, 0);
+      liveness.live_out.assign(count, 0);
+      auto &live_in = liveness.live_in;
+      auto &live_out = liveness.live_out;
+
+      // iterate until nothing changes, loops need more than one pass
+      for (bool updated = true; updated;) {
+        updated = false;
+
+        for (size_t i = count; i-- > 0;) {
+          const auto &instr = instrs[i];
+          const arm::addr_t address = fun.address + i * sizeof(arm::instr_t);
+
+          uint8_t next = i + 1 < count ? live_in[i + 1] : FLAGS_ALL;
+          uint8_t out = next, kill = flags_written(instr);
+
+          if (instr.group == arm::InstructionGroup::BRANCH) {
+            Function *mapped = nullptr;
+            arm::addr_t target = branch_target(instr, address, mapped);
+
+            if (instr.branch.link || (mapped && mapped->is_external)) {
+              kill = FLAGS_ALL;
+            } else if (target >= fun.address && target < fun.end &&
+                       !(target & 3)) {
+              out = live_in[(target - fun.address) / sizeof(arm::instr_t)];
+              if (instr.cond != arm::Condition::AL) {
+                out |= next;
+              }
+            } else {
+              out = FLAGS_ALL;
+            }
+          } else if (instr.is_return()) {
+            out = returns ? FLAGS_ALL : 0;
+            if (instr.cond != arm::Condition::AL) {
+              out |= next;
+            }
+          } else if (instr.writes_pc()) {
+            out = FLAGS_ALL;
+          }
+
+          // conditional instructions might not execute, so they kill nothing
+          uint8_t in = flags_read(instr) |
+                       (instr.cond == arm::Condition::AL ? out & ~kill : out);
+
+          if (in != live_in[i] || out != live_out[i]) {
+            live_in[i] = in;
+            live_out[i] = out;
+            updated = true;
+          }
+        }
+      }
+
+      for (size_t i = 0; i < count; i++) {
+        const auto &instr = instrs[i];
+        const arm::addr_t address = fun.address + i * sizeof(arm::instr_t);
+        uint8_t site = i + 1 < count ? live_in[i + 1] : FLAGS_ALL;
+
+        if (instr.group == arm::InstructionGroup::BRANCH) {
+          Function *mapped = nullptr;
+          arm::addr_t target = branch_target(instr, address, mapped);
+
+          if (mapped && mapped->is_external) {
+            continue;
+          }
+
+          // callee returns flags that are read at the return site
+          if (instr.branch.link && site) {
+            mark(target);
+          }
+
+          // jumping out of a function also returns from it
+          if (!instr.branch.link && returns &&
+              (target < fun.address || target >= fun.end)) {
+            mark(target);
+          }
+        } else if (i > 0 && instr.writes_pc() && site && !returns_flags_all &&
+                   instrs[i - 1].group ==
+                       arm::InstructionGroup::DATA_PROCESSING &&
+                   instrs[i - 1].data.rd == arm::Register::LR) {
+          // return site of an indirect call (`mov lr, pc; bx rN`), callee is
+          // unknown
+          returns_flags_all = true;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  size_t reduced = 0;
+
+  for (auto &function : functions) {
+    const auto &liveness = function.second;
+
+    for (size_t i = 0; i < liveness.instrs.size(); i++) {
+      uint8_t written = flags_written(liveness.instrs[i]);
+      if (!written) {
+        continue;
+      }
+
+      _flags_live[function.first + i * sizeof(arm::instr_t)] =
+          written & liveness.live_out[i];
+
+      if ((written & liveness.live_out[i]) != written) {
+        reduced++;
+      }
+    }
+  }
+
+  std::cout << "\tReduced flags of " << reduced << " instructions!"
+            << std::endl;
+}
+
+// This step propagates register values that are known at recompile time
+// trough each basic block. Those come from PC-relative literal loads
+// (`ldr rX, [pc, #imm]`), address arithmetic on PC (`add rX, pc, rY`) and
+// loads from read-only sections at a known address. Such instructions are then
+// emitted as plain constants, without touching guest memory at all.
+void Recompiler::analyze_constants() {
+  std::cout << "> Propagating constants ..." << std::endl;
+
+  for (auto &function : _funs_guest) {
+    const auto &fun = function.second;
+
+    bool known[16] = {false};
+    uint32_t values[16] = {0};
+
+    for (arm::addr_t address = fun.address; address < fun.end;
+         address += sizeof(arm::instr_t)) {
+      // values only flow trough straight-line code
+      if (_leaders.count(address)) {
+        std::fill(std::begin(known), std::end(known), false);
+      }
+
+      arm::instr_t instr_raw;
+      read_word(address, instr_raw);
+      auto instr = arm::Instruction::decode(instr_raw);
+
+      // PC always holds address of the current instruction + 8
+      known[REG_PC] = true;
+      values[REG_PC] = address + 8;
+
+      bool folded = false;
+      arm::Register rd = arm::Register::PC;
+      uint32_t value = 0;
+
+      if (instr.group == arm::InstructionGroup::DATA_PROCESSING &&
+          !instr.set_cond) {
+        const auto &op2 = instr.data.op2_reg;
+        rd = instr.data.rd;
+
+        bool has_op2 = instr.is_imm || (!op2.is_reg && !op2.amount_or_rs &&
+                                        op2.type == arm::ShifterType::LSL &&
+                                        known[(int)op2.rm]);
+        uint32_t rn = values[(int)instr.data.rn];
+        uint32_t op2_value =
+            instr.is_imm ? instr.data.op2_imm : values[(int)op2.rm];
+
+        if (has_op2) {
+          switch (instr.data.op) {
+          case arm::Opcode::MOV:
+            folded = true;
+            value = op2_value;
+            break;
+
+          case arm::Opcode::ADD:
+            folded = known[(int)instr.data.rn];
+            value = rn + op2_value;
+            break;
+
+          case arm::Opcode::SUB:
+            folded = known[(int)instr.data.rn];
+            value = rn - op2_value;
+            break;
+
+          default:
+            break;
+          }
+        }
+      } else if (instr.group == arm::InstructionGroup::SINGLE_DATA_TRANSFER &&
+                 instr.data_trans.load && instr.is_imm &&
+                 instr.data_trans.pre_indx && !instr.data_trans.write_back &&
+                 known[(int)instr.data_trans.rn]) {
+        rd = instr.data_trans.rd;
+
+        arm::addr_t load_address =
+            values[(int)instr.data_trans.rn] +
+            (instr.data_trans.add ? instr.data_trans.offset_imm
+                                  : -instr.data_trans.offset_imm);
+
+        if (instr.data_trans.byte) {
+          folded = read_constant(load_address & ~3, value);
+          value = (value >> ((load_address & 3) * 8)) & 0xff;
+        } else {
+          folded = !(load_address & 3) && read_constant(load_address, value);
+        }
+      }
+
+      // PC writes are jumps and have to stay as they are
+      if (folded && rd != arm::Register::PC) {
+        _constants[address] = Constant{.rd = rd, .value = value};
+      } else {
+        folded = false;
+      }
+
+      for (int reg = 0; reg < 16; reg++) {
+        if ((regs_written(instr) >> reg) & 1) {
+          known[reg] = false;
+        }
+      }
+
+      // conditional instructions might not execute
+      if (folded && instr.cond == arm::Condition::AL) {
+        known[(int)rd] = true;
+        values[(int)rd] = value;
+      }
+    }
+  }
+
+  std::cout << "\tFolded " << _constants.size() << " instructions!"
+            << std::endl;
+}
+
+// Guest stack memory that an instruction accesses, relative to SP at function
+// entry.
+struct StackAccess {
+  arm::addr_t address; /* Instruction that accesses it */
+  int32_t offset, size;
+  bool load;
+  bool slot; /* Plain word `ldr`/`str`, which can use a local instead */
+};
+
+// Follows SP trough the instruction: `delta` is SP offset from the function
+// entry before the instruction and is updated to the offset after it. Stack
+// memory that it accesses is added to `accesses`. Returns false if SP can't be
+// followed, because it's set to an unknown value or escapes into another
+// register or memory.
+static bool track_sp(const arm::Instruction &instr, arm::addr_t address,
+                     int32_t &delta, std::vector<StackAccess> &accesses) {
+  const auto sp = arm::Register::SP;
+
+  switch (instr.group) {
+  case arm::InstructionGroup::DATA_PROCESSING:
+    // `add sp, sp, #imm` and `sub sp, sp, #imm`
+    if (instr.data.rd == sp && instr.data.rn == sp && instr.is_imm &&
+        instr.cond == arm::Condition::AL &&
+        (instr.data.op == arm::Opcode::ADD ||
+         instr.data.op == arm::Opcode::SUB)) {
+      const int32_t imm = instr.data.op2_imm;
+      delta += instr.data.op == arm::Opcode::ADD ? imm : -imm;
+      return true;
+    }
+    break;
+
+  case arm::InstructionGroup::SINGLE_DATA_TRANSFER:
+  case arm::InstructionGroup::HALFWORD_DATA_TRANSFER: {
+    const bool single =
+        instr.group == arm::InstructionGroup::SINGLE_DATA_TRANSFER;
+    const auto &trans = instr.data_trans;
+    const auto &hw_trans = instr.hw_data_trans;
+
+    if ((single ? trans.rn : hw_trans.rn) != sp) {
+      break;
+    }
+
+    if (!instr.is_imm || (single ? trans.rd : hw_trans.rd) == sp) {
+      return false;
+    }
+
+    const bool pre_indx = single ? trans.pre_indx : hw_trans.pre_indx;
+    const bool write_back = single ? trans.write_back : hw_trans.write_back;
+    const bool add = single ? trans.add : hw_trans.add;
+    const int32_t offset = single ? trans.offset_imm : hw_trans.offset_imm;
+
+    int32_t size = sizeof(uint32_t);
+    if (single && trans.byte) {
+      size = sizeof(uint8_t);
+    } else if (!single) {
+      size = hw_trans.type == arm::HalfWordTransferType::SB ? sizeof(uint8_t)
+                                                            : sizeof(uint16_t);
+    }
+
+    accesses.push_back(StackAccess{
+        .address = address,
+        .offset = pre_indx ? delta + (add ? offset : -offset) : delta,
+        .size = size,
+        .load = single ? trans.load : hw_trans.load,
+        .slot = single && pre_indx && !write_back && !trans.byte &&
+                trans.rd != arm::Register::PC,
+    });
+
+    if (write_back || !pre_indx) {
+      if (instr.cond != arm::Condition::AL) {
+        return false;
+      }
+
+      delta += add ? offset : -offset;
+    }
+
+    return true;
+  }
+
+  case arm::InstructionGroup::BLOCK_DATA_TRANSFER: {
+    const auto &trans = instr.blk_data_trans;
+    if (trans.rn != sp) {
+      break;
+    }
+
+    if ((trans.reg_list >> (int)sp) & 1) {
+      return false;
+    }
+
+    const int32_t size = __builtin_popcount(trans.reg_list) * 4;
+    int32_t offset = trans.add ? delta : delta - size;
+    if (trans.pre_indx) {
+      offset += trans.add ? 4 : 0;
+    } else {
+      offset += trans.add ? 0 : 4;
+    }
+
+    accesses.push_back(StackAccess{
+        .address = address,
+        .offset = offset,
+        .size = size,
+        .load = trans.load,
+        .slot = false,
+    });
+
+    if (trans.write_back) {
+      if (instr.cond != arm::Condition::AL) {
+        return false;
+      }
+
+      delta += trans.add ? size : -size;
+    }
+
+    return true;
+  }
+
+  // calls preserve SP
+  case arm::InstructionGroup::BRANCH:
+  case arm::InstructionGroup::SWI:
+    return true;
+
+  default:
+    break;
+  }
+
+  return !instr.reads(sp) && !((regs_written(instr) >> (int)sp) & 1);
+}
+
+// This step looks for spill slots: words in the stack frame of a function that
+// are only accessed by `ldr`/`str` at a constant offset from SP. Such slots can
+// be kept in C++ locals. SP offset from the function entry is followed trough
+// the control flow, the function is skipped if it isn't the same on every path
+// or if SP escapes (e.g. `mov r0, sp`), since then anything could point into
+// the frame. Locals are written back to the stack whenever registers are, so
+// callees and the rest of the program still see the frame in memory.
+//
+// Known SP also finds tail calls: an unconditional `b` to another function
+// once the frame is torn down. Those are emitted as host tail calls, so the
+// two functions don't have to share control flow.
+void Recompiler::analyze_frames() {
+  std::cout << "> Analyzing stack frames ..." << std::endl;
+
+  size_t slots = 0;
+
+  for (auto &function : _funs_guest) {
+    const auto &fun = function.second;
+    const size_t count = (fun.end - fun.address) / sizeof(arm::instr_t);
+
+    std::vector<arm::Instruction> instrs;
+    for (size_t i = 0; i < count; i++) {
+      arm::instr_t instr_raw;
+      read_word(fun.address + i * sizeof(arm::instr_t), instr_raw);
+      instrs.push_back(arm::Instruction::decode(instr_raw));
+    }
+
+    std::vector<std::optional<int32_t>> deltas(count);
+    std::vector<StackAccess> accesses;
+    std::vector<size_t> work;
+    bool valid = true;
+
+    auto reach = [&](arm::addr_t target, int32_t delta) {
+      if (target < fun.address || target >= fun.end || (target & 3)) {
+        return;
+      }
+
+      auto &known = deltas[(target - fun.address) / sizeof(arm::instr_t)];
+      if (!known) {
+        known = delta;
+        work.push_back((target - fun.address) / sizeof(arm::instr_t));
+      } else if (*known != delta) {
+        valid = false;
+      }
+    };
+
+    reach(fun.address, 0);
+
+    while (valid && !work.empty()) {
+      const size_t i = work.back();
+      work.pop_back();
+
+      const auto &instr = instrs[i];
+      const arm::addr_t address = fun.address + i * sizeof(arm::instr_t);
+      const arm::addr_t next = address + sizeof(arm::instr_t);
+      int32_t delta = *deltas[i];
+
+      if (!track_sp(instr, address, delta, accesses)) {
+        valid = false;
+        break;
+      }
+
+      if (_jump_tables.count(address)) {
+        for (auto target : _jump_tables[address].targets) {
+          reach(target, delta);
+        }
+      }
+
+      if (instr.group == arm::InstructionGroup::BRANCH) {
+        Function *mapped = nullptr;
+        arm::addr_t target = branch_target(instr, address, mapped);
+
+        if (!instr.branch.link) {
+          reach(target, delta);
+        }
+
+        if (instr.branch.link || instr.cond != arm::Condition::AL) {
+          reach(next, delta);
+        }
+      } else if (!instr.writes_pc() || instr.cond != arm::Condition::AL) {
+        reach(next, delta);
+      } else if (!instr.is_return() && i > 0 &&
+                 instrs[i - 1].group ==
+                     arm::InstructionGroup::DATA_PROCESSING &&
+                 instrs[i - 1].data.rd == arm::Register::LR) {
+        // return site of an indirect call (`mov lr, pc; bx rN`)
+        reach(next, delta);
+      }
+    }
+
+    // every leader has to have a known frame, so it can be entered
+    Frame frame;
+
+    for (size_t i = 0; valid && i < count; i++) {
+      const arm::addr_t address = fun.address + i * sizeof(arm::instr_t);
+      if (_data_words.count(address) || !_leaders.count(address)) {
+        continue;
+      }
+
+      if (!deltas[i]) {
+        valid = false;
+      } else if (*deltas[i]) {
+        frame.entries[address] = *deltas[i];
+      }
+    }
+
+    if (!valid) {
+      continue;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      const auto &instr = instrs[i];
+      const arm::addr_t address = fun.address + i * sizeof(arm::instr_t);
+
+      if (!deltas[i] || *deltas[i] || _data_words.count(address) ||
+          instr.group != arm::InstructionGroup::BRANCH || instr.branch.link ||
+          instr.cond != arm::Condition::AL) {
+        continue;
+      }
+
+      Function *mapped = nullptr;
+      arm::addr_t target = branch_target(instr, address, mapped);
+
+      if (target != fun.address && _funs_guest.count(target)) {
+        _tail_calls.insert(address);
+      }
+    }
+
+    // slots below the entry SP, which are both written and read
+    std::map<int32_t, uint8_t> candidates;
+
+    for (auto &access : accesses) {
+      if (access.slot && access.offset < 0 && !(access.offset & 3)) {
+        candidates[access.offset] |= access.load ? 1 : 2;
+      }
+    }
+
+    for (auto &candidate : candidates) {
+      if (candidate.second != 3) {
+        continue;
+      }
+
+      bool shared = false;
+      for (auto &access : accesses) {
+        shared |= !(access.slot && access.offset == candidate.first) &&
+                  access.offset < candidate.first + 4 &&
+                  access.offset + access.size > candidate.first;
+      }
+
+      if (!shared) {
+        frame.slots.insert(candidate.first);
+      }
+    }
+
+    if (frame.slots.empty()) {
+      continue;
+    }
+
+    for (auto &access : accesses) {
+      if (access.slot && frame.slots.count(access.offset)) {
+        _slot_accesses[access.address] = access.offset;
+      }
+    }
+
+    slots += frame.slots.size();
+    _frames[fun.address] = std::move(frame);
+  }
+
+  std::cout << "\tPromoted " << slots << " spill slots in " << _frames.size()
+            << " functions!" << std::endl;
+  std::cout << "\tFound " << _tail_calls.size() << " tail calls!" << std::endl;
+}
+
+// Returns code section that contains the address, or nullptr if there is none.
+const ELFIO::section *Recompiler::code_section(arm::addr_t address) {
+  for (auto &section : _elf.sections) {
+    if (!section_is_code(section.get())) {
+      continue;
+    }
+
+    if (address >= section->get_address() &&
+        address < section->get_address() + section->get_size()) {
+      return section.get();
+    }
+  }
+
+  return nullptr;
+}
+
+// Returns allocated section with data that contains the address, or nullptr
+// if there is none.
+const ELFIO::section *Recompiler::section_at(arm::addr_t address) {
+  for (auto &section : _elf.sections) {
+    if (!section->get_data() || !(section->get_flags() & ELFIO::SHF_ALLOC)) {
+      continue;
+    }
+
+    if (address >= section->get_address() &&
+        address + sizeof(uint32_t) <=
+            section->get_address() + section->get_size()) {
+      return section.get();
+    }
+  }
+
+  return nullptr;
+}
+
+// Reads a word from the image, returns false if the address isn't backed by
+// any data.
+bool Recompiler::read_word(arm::addr_t address, uint32_t &value) {
+  const auto *section = section_at(address);
+  if (!section) {
+    return false;
+  }
+
+  memcpy(&value, section->get_data() + (address - section->get_address()),
+         sizeof(uint32_t));
+  return true;
+}
+
+// Reads a word that can't change at runtime: one in a read-only section,
+// which isn't a target of a relocation.
+bool Recompiler::read_constant(arm::addr_t address, uint32_t &value) {
+  const auto *section = section_at(address);
+  if (!section || (section->get_flags() & ELFIO::SHF_WRITE) ||
+      section->get_name().find(".got") != std::string::npos) {
+    return false;
+  }
+
+  for (auto &mapping : _got_mappings) {
+    if (std::get<0>(mapping) == address) {
+      return false;
+    }
+  }
+
+  return read_word(address, value);
+}
+
+// Calculates where B/BL instruction at the address jumps to. Branches to .plt
+// are resolved to the function they belong to, `mapped` is set in that case.
+arm::addr_t Recompiler::branch_target(const arm::Instruction &instr,
+                                      arm::addr_t address, Function *&mapped) {
+  arm::addr_t target = (int64_t)(address + 8) + instr.branch.offset;
+  mapped = nullptr;
+
+  if (_fun_deps_mapped.count(target)) {
+    mapped = _fun_deps_mapped[target];
+
+    if (!mapped->is_external) {
+      target = mapped->address;
+    }
+  }
+
+  return target;
+}
+
 } // namespace charm::recomp
@@ -1,13 +1,15 @@
 #include "elfio/elf_types.hpp"
 #include "libcharm/arm.hpp"
 #include "libcharm/recomp.hpp"
+#include "libcharm/writer.hpp"
 #include "liblayer/liblayer.hpp"
 #include <algorithm>
 #include <cctype>
 #include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
-#include <sstream>
+#include <limits>
 #include <stdexcept>
 #include <string>
 
@@ -43,10 +45,6 @@ const std::array<std::string, 4> SHIFT_TABLE = {
 
 namespace charm::recomp {
 
-std::string symbol_name_map(const std::string &symbol);
-bool section_is_data(const ELFIO::section *section);
-bool section_is_code(const ELFIO::section *section);
-
 void Recompiler::step_emit(const std::string &output_dir) {
   const auto liblayer_path =
       std::filesystem::current_path() / "deps" / "liblayer";
@@ -65,6 +63,7 @@ void Recompiler::step_emit(const std::string &output_dir) {
   }
 
   emit_makefile(output_dir);
+  emit_sources(output_dir);
 
   std::cout << "> Code ..." << std::endl;
   emit_code_header(output_dir);
@@ -83,7 +82,8 @@ void Recompiler::emit_makefile(const std::string &output_dir) {
     return;
   }
 
-  std::ofstream ofs{makefile_path};
+  // never minified, recipes need their tabs
+  Writer ofs{makefile_path};
 
   ofs << "CXX ?= c++" << std::endl;
   ofs << "OPT = -O2" << std::endl;
@@ -91,15 +91,18 @@ void Recompiler::emit_makefile(const std::string &output_dir) {
       << std::endl
       << std::endl;
 
-  ofs << "SRCS = code.cpp data.cpp" << std::endl;
+  // SRCS comes from sources.mk, which is rewritten on every run
+  ofs << "include sources.mk" << std::endl;
   ofs << "OBJS = $(SRCS:.cpp=.o)" << std::endl;
   ofs << "NAME = exec" << std::endl << std::endl;
 
   ofs << "RELEASE ?= 1" << std::endl;
-  ofs << "SHARED ?= 0" << std::endl << std::endl;
+  ofs << "SHARED ?= 0" << std::endl;
+  ofs << "LOCAL_REGS ?= 1" << std::endl;
+  ofs << "FASTMEM ?= 0" << std::endl << std::endl;
 
   ofs << "ifeq ($(RELEASE),0)" << std::endl
-      << "\tCXXFLAGS += -g" << std::endl
+      << "\tCXXFLAGS += -g -DLIBLAYER_TRACK_PC" << std::endl
       << "else" << std::endl
       << "\tCXXFLAGS += -O3" << std::endl
       << "endif" << std::endl
@@ -113,6 +116,17 @@ void Recompiler::emit_makefile(const std::string &output_dir) {
       << "endif" << std::endl
       << std::endl;
 
+  ofs << "ifeq ($(LOCAL_REGS),1)" << std::endl
+      << "\tCXXFLAGS += -DLIBLAYER_LOCAL_REGS" << std::endl
+      << "endif" << std::endl
+      << std::endl;
+
+  // guest memory in one 4 GB reservation, see liblayer.hpp
+  ofs << "ifeq ($(FASTMEM),1)" << std::endl
+      << "\tCXXFLAGS += -DLIBLAYER_FASTMEM" << std::endl
+      << "endif" << std::endl
+      << std::endl;
+
   ofs << ".PHONY: all clean" << std::endl;
   ofs << "all: $(EXEC)" << std::endl << std::endl;
 
@@ -122,12 +136,44 @@ void Recompiler::emit_makefile(const std::string &output_dir) {
   ofs << "%.o:%.cpp" << std::endl;
   ofs << "\t$(CXX) $(CXXFLAGS) -c $< -o $@" << std::endl << std::endl;
 
+  // data sections included from .bin files (--embed-data)
+  ofs << "data.o: $(wildcard *.bin)" << std::endl << std::endl;
+
   ofs << "clean:" << std::endl;
   ofs << "\trm -f $(OBJS) $(NAME) $(NAME).so" << std::endl;
+
+  ofs.close();
+}
+
+// Source files of the project, which change with the number of shards.
+// Shards left over from a previous run with more of them are removed.
+void Recompiler::emit_sources(const std::string &output_dir) {
+  const size_t shards = _shards > 1 ? _shards : 0;
+
+  for (size_t i = shards;; i++) {
+    auto path = std::filesystem::path{output_dir} / shard_name(i);
+    if (!std::filesystem::exists(path)) {
+      break;
+    }
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(path.replace_extension(".o"));
+  }
+
+  Writer ofs{std::filesystem::path{output_dir} / "sources.mk"};
+
+  ofs << "SRCS = code.cpp";
+  for (size_t i = 0; i < shards; i++) {
+    ofs << " " << shard_name(i);
+  }
+
+  ofs << " data.cpp" << std::endl;
+
+  ofs.close();
 }
 
 void Recompiler::emit_code_header(const std::string &output_dir) {
-  std::ofstream ofs{
+  Writer ofs{
       std::filesystem::path{std::filesystem::path{output_dir} / "code.hpp"},
   };
 
@@ -140,16 +186,33 @@ void Recompiler::emit_code_header(const std::string &output_dir) {
   ofs << "#include <liblayer/liblayer.hpp>" << std::endl;
   ofs << "#define INSTR_RETURN_LR (0xFFFFFFFF)" << std::endl << std::endl;
 
-  ofs << "class ProgramState : public ExecutionState {" << std::endl;
+  // final, so instructions call address_resolve directly instead of through
+  // the vtable
+  ofs << "class ProgramState final : public BasicExecutionState<ProgramState> {"
+      << std::endl;
   ofs << "public:" << std::endl;
+  ofs << "\tProgramState();" << std::endl;
   ofs << "\tuint32_t address_map(uintptr_t addr) override;" << std::endl;
   ofs << "\tuintptr_t address_resolve(uint32_t addr) override;" << std::endl;
   ofs << "};" << std::endl << std::endl;
 
-  ofs << "void eval(ProgramState& ps, uint32_t address);" << std::endl
+  ofs << "void eval(ProgramState& ps, uint32_t address);" << std::endl;
+  ofs << "COLD uint32_t eval_slow_path(ProgramState& ps, uint32_t address);"
+      << std::endl
       << std::endl;
 
-  ofs << MINIFY_COMMENT("/* EXPORTED FUNCTIONS */") << std::endl << std::endl;
+  ofs << MINIFY_COMMENT("/* GUEST FUNCTIONS */") << std::endl << std::endl;
+
+  for (auto &function : _funs_guest) {
+    ofs << "uint32_t f0x" << std::hex << function.first << std::dec
+        << "(ProgramState& state, uint32_t address, uint32_t ret, "
+           "uint32_t depth);"
+        << std::endl;
+  }
+
+  ofs << std::endl
+      << MINIFY_COMMENT("/* EXPORTED FUNCTIONS */") << std::endl
+      << std::endl;
 
   for (auto &functions : _funs_exports) {
     ofs << "void internal_" << symbol_name_map(functions.second.name)
@@ -168,27 +231,17 @@ void Recompiler::emit_code_header(const std::string &output_dir) {
     ofs << "void external_" << symbol_name_map(functions.second.name)
         << "(ProgramState& ps);" << std::endl;
   }
+
+  ofs.close();
 }
 
 void Recompiler::emit_code_source(const std::string &output_dir) {
-  std::ofstream ofs{
+  Writer ofs{
       std::filesystem::path{std::filesystem::path{output_dir} / "code.cpp"},
+      _minify,
   };
 
-  ofs << "/* THIS FILE IS AUTO-GENERATED BY charm STATIC "
-         "RECOMPILER! DO NOT "
-         "MODIFY DIRECTLY! */"
-      << std::endl;
-
-  ofs << "#define LIBLAYER_IMPL" << std::endl;
-  ofs << "#include <iostream>" << std::endl;
-  ofs << "#include <stdexcept>" << std::endl;
-  ofs << "#include <string>" << std::endl;
-  ofs << "#include <liblayer/liblayer.hpp>" << std::endl;
-  ofs << "#include \"code.hpp\"" << std::endl;
-  ofs << "#include \"data.hpp\"" << std::endl << std::endl;
-  ofs << "#define INSTR(ADDR) case ADDR: a##ADDR: ps.r[REG_PC] = ADDR+8;"
-      << std::endl;
+  emit_code_prelude(ofs, true);
 
   ofs << std::endl
       << MINIFY_COMMENT("/* ADDRESS MAPPING */") << std::endl
@@ -197,41 +250,189 @@ void Recompiler::emit_code_source(const std::string &output_dir) {
   emit_code_address_mappings(ofs);
   emit_code_stubs(ofs);
 
-  ofs << "void eval(ProgramState& ps, uint32_t address) {" << std::endl;
-  ofs << "__start__:" << std::endl;
-  ofs << "\tswitch(address) {" << std::endl;
+  // guest functions are either here or split into shards, which can be
+  // compiled in parallel
+  const auto bounds = shard_bounds();
 
-  ofs << MINIFY_COMMENT(
-             "\t// this is a special address that is used to return out of "
-             "function when PC is set it.")
-      << std::endl;
+  if (bounds.size() == 2) {
+    for (auto &section : _elf.sections) {
+      if (!section_is_code(section.get())) {
+        continue;
+      }
 
-  ofs << "\tINSTR(INSTR_RETURN_LR) {" << std::endl;
-  ofs << "\t\treturn;" << std::endl;
-  ofs << "\t}" << std::endl << std::endl;
+      emit_code_section(ofs, section.get(), bounds[0], bounds[1]);
+    }
+  } else {
+    for (size_t i = 0; i + 1 < bounds.size(); i++) {
+      std::cout << "\tShard " << shard_name(i) << " ..." << std::endl;
 
-  for (auto &section : _elf.sections) {
-    if (!section_is_code(section.get())) {
-      continue;
+      Writer shard{
+          std::filesystem::path{std::filesystem::path{output_dir} /
+                                shard_name(i)},
+          _minify,
+      };
+
+      emit_code_prelude(shard, false);
+
+      for (auto &section : _elf.sections) {
+        if (!section_is_code(section.get())) {
+          continue;
+        }
+
+        emit_code_section(shard, section.get(), bounds[i], bounds[i + 1]);
+      }
+
+      shard.close();
     }
+  }
+
+  emit_code_dispatcher(ofs);
+
+  ofs.close();
+}
 
-    emit_code_section(ofs, section.get());
+// Splits guest functions into contiguous ranges of roughly the same size, one
+// for each shard. Returns the start address of each range, followed by the end
+// of the last one.
+std::vector<arm::addr_t> Recompiler::shard_bounds() {
+  std::vector<arm::addr_t> bounds{0};
+
+  size_t total = 0;
+  for (auto &function : _funs_guest) {
+    total += function.second.end - function.second.address;
   }
 
-  ofs << "\tdefault:" << std::endl;
+  size_t size = 0;
+  for (auto &function : _funs_guest) {
+    if (bounds.size() < _shards && size * _shards >= total * bounds.size()) {
+      bounds.push_back(function.first);
+    }
 
-  if (_minify) {
-    ofs << "\t\t__builtin_unreachable();";
-  } else {
-    ofs << "\t\tthrow std::runtime_error(\"Invalid address: \" + "
-           "std::to_string(address));";
+    size += function.second.end - function.second.address;
   }
 
-  ofs << std::endl << "\t}" << std::endl << "}" << std::endl;
+  // shards without any functions (after a very big function) are still
+  // emitted, sources.mk lists them all
+  while (bounds.size() < std::max<size_t>(_shards, 1)) {
+    bounds.push_back(std::numeric_limits<arm::addr_t>::max());
+  }
+
+  bounds.push_back(std::numeric_limits<arm::addr_t>::max());
+  return bounds;
+}
+
+std::string Recompiler::shard_name(size_t index) {
+  char name[32] = {0};
+  snprintf(name, sizeof(name), "code_%03zu.cpp", index);
+  return name;
+}
+
+// Everything that code.cpp and its shards share: includes and macros used by
+// the recompiled functions. Only code.cpp (`impl`) contains liblayer itself.
+void Recompiler::emit_code_prelude(std::ostream &ofs, bool impl) {
+  ofs << "/* THIS FILE IS AUTO-GENERATED BY charm STATIC "
+         "RECOMPILER! DO NOT "
+         "MODIFY DIRECTLY! */"
+      << std::endl;
+
+  ofs << (impl ? "#define LIBLAYER_IMPL" : "#define LIBLAYER_INSTRUCTIONS")
+      << std::endl;
+  ofs << "#include <algorithm>" << std::endl;
+  ofs << "#include <iostream>" << std::endl;
+  ofs << "#include <iterator>" << std::endl;
+  ofs << "#include <stdexcept>" << std::endl;
+  ofs << "#include <string>" << std::endl;
+  ofs << "#include <liblayer/liblayer.hpp>" << std::endl;
+  ofs << "#include \"code.hpp\"" << std::endl;
+  ofs << "#include \"data.hpp\"" << std::endl << std::endl;
+  // PC is only written for instructions that read it and before calling
+  // stubs. With LIBLAYER_TRACK_PC every instruction updates it, so that
+  // faults and profilers can tell where the execution is.
+  ofs << "#define SET_PC(ADDR) ps.r[REG_PC] = ADDR+8;" << std::endl;
+  ofs << "#ifdef LIBLAYER_TRACK_PC" << std::endl;
+  ofs << "#define TRACK_PC(ADDR) SET_PC(ADDR)" << std::endl;
+  ofs << "#else" << std::endl;
+  ofs << "#define TRACK_PC(ADDR)" << std::endl;
+  ofs << "#endif" << std::endl;
+  ofs << "#define INSTR(ADDR) a##ADDR: TRACK_PC(ADDR)" << std::endl
+      << std::endl;
+
+  // Functions operate on `ps`, which is either the state itself or its local
+  // copy. STORE / LOAD synchronize the copy whenever control leaves the
+  // function, so generated code doesn't depend on the mode.
+  ofs << MINIFY_COMMENT("/* REGISTERS */") << std::endl;
+  // Functions with spill slots in locals (see analyze_frames) redefine
+  // FRAME_STORE / FRAME_LOAD to synchronize them with the stack as well.
+  ofs << "#define FRAME_STORE()" << std::endl;
+  ofs << "#define FRAME_LOAD()" << std::endl;
+  ofs << "#ifdef LIBLAYER_LOCAL_REGS" << std::endl;
+  ofs << "#define ENTER() LocalState<ProgramState> ps{state};" << std::endl;
+  ofs << "#define STORE() FRAME_STORE() ps.store();" << std::endl;
+  ofs << "#define LOAD() ps.load(); FRAME_LOAD()" << std::endl;
+  ofs << "#else" << std::endl;
+  ofs << "#define ENTER() ProgramState& ps = state;" << std::endl;
+  ofs << "#define STORE() FRAME_STORE()" << std::endl;
+  ofs << "#define LOAD() FRAME_LOAD()" << std::endl;
+  ofs << "#endif" << std::endl << std::endl;
+
+  // BL to a guest function is a host call that gets the expected return
+  // address, the host stack works as a shadow stack. If callee returns
+  // somewhere else (or the stack is too deep), the address is dispatched.
+  ofs << MINIFY_COMMENT("/* CALLS */") << std::endl;
+  ofs << "#ifndef LIBLAYER_CALL_DEPTH" << std::endl;
+  ofs << "#define LIBLAYER_CALL_DEPTH (1024)" << std::endl;
+  ofs << "#endif" << std::endl;
+  ofs << "#define CALL(FN, ADDR, RET) { if(depth >= LIBLAYER_CALL_DEPTH) { "
+         "STORE() return ADDR; } STORE() address = FN(state, ADDR, RET, "
+         "depth + 1); LOAD() if(address != RET) goto __start__; }"
+      << std::endl;
+  ofs << "#define RETURN() { if(address == ret) { STORE() return address; } "
+         "goto __start__; }"
+      << std::endl;
+
+  // B to another function with the frame torn down is a tail call, callee
+  // returns to our caller directly. Without musttail it's a call and return,
+  // which counts towards the depth.
+  ofs << "#if defined(__clang__) && defined(__has_cpp_attribute)" << std::endl;
+  ofs << "#if __has_cpp_attribute(clang::musttail)" << std::endl;
+  ofs << "#define LIBLAYER_MUSTTAIL" << std::endl;
+  ofs << "#endif" << std::endl;
+  ofs << "#endif" << std::endl;
+  ofs << "#ifdef LIBLAYER_MUSTTAIL" << std::endl;
+  ofs << "#define TAIL_CALL(FN, ADDR) { STORE() [[clang::musttail]] return "
+         "FN(state, ADDR, ret, depth); }"
+      << std::endl;
+  ofs << "#else" << std::endl;
+  ofs << "#define TAIL_CALL(FN, ADDR) { if(depth >= LIBLAYER_CALL_DEPTH) { "
+         "STORE() return ADDR; } STORE() return FN(state, ADDR, ret, depth + "
+         "1); }"
+      << std::endl;
+  ofs << "#endif" << std::endl << std::endl;
+
+  // Every function starts with DISPATCH, listing each of its words as either
+  // a leader L(ADDR) or X. With computed goto this becomes a dense label
+  // table indexed by (address - base) >> 2, otherwise a switch over leaders.
+  // Rotating the offset makes unaligned addresses fail the bounds check too.
+  ofs << MINIFY_COMMENT("/* DISPATCH */") << std::endl;
+  ofs << "#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)" << std::endl;
+  ofs << "#define DISPATCH(BASE, COUNT, ...) static void* const "
+         "__labels__[COUNT] = {__VA_ARGS__}; __start__: { uint32_t index = "
+         "address - BASE; index = (index >> 2) | (index << 30); if(index < "
+         "COUNT) goto *__labels__[index]; } goto __exit__;"
+      << std::endl;
+  ofs << "#define L(ADDR) &&a##ADDR," << std::endl;
+  ofs << "#define X &&__exit__," << std::endl;
+  ofs << "#else" << std::endl;
+  ofs << "#define DISPATCH(BASE, COUNT, ...) __start__: switch(address) { "
+         "__VA_ARGS__ default: goto __exit__; }"
+      << std::endl;
+  ofs << "#define L(ADDR) case ADDR: goto a##ADDR;" << std::endl;
+  ofs << "#define X" << std::endl;
+  ofs << "#endif" << std::endl;
 }
 
 void Recompiler::emit_data_header(const std::string &output_dir) {
-  std::ofstream ofs{
+  Writer ofs{
       std::filesystem::path{std::filesystem::path{output_dir} / "data.hpp"},
   };
 
@@ -274,10 +475,12 @@ void Recompiler::emit_data_header(const std::string &output_dir) {
         << ") /* Size of " << section->get_name() << " */ " << std::endl
         << std::endl;
   }
+
+  ofs.close();
 }
 
 void Recompiler::emit_data_source(const std::string &output_dir) {
-  std::ofstream ofs{
+  Writer ofs{
       std::filesystem::path{std::filesystem::path{output_dir} / "data.cpp"},
   };
 
@@ -299,22 +502,35 @@ void Recompiler::emit_data_source(const std::string &output_dir) {
     auto name = symbol_name_map(section->get_name());
     std::transform(name.begin(), name.end(), name.begin(), ::toupper);
 
-    std::stringstream ss;
-
-    // for non-got table we just write raw bytes or 0es
+    // for non-got table we just write raw bytes
     if (section->get_name().find(".got") == std::string::npos) {
+      // .bss and such, zero-initialized by C++ without any initializer
+      if (section->get_type() == ELFIO::SHT_NOBITS || !data) {
+        ofs << ((section->get_flags() & ELFIO::SHF_WRITE) ? "uint8_t g_"
+                                                          : "const uint8_t g_")
+            << name << "_DATA[" << section->get_size() << "]"
+            << ((section->get_flags() & ELFIO::SHF_WRITE) ? "" : " = {}")
+            << ";" << std::endl
+            << std::endl;
+        continue;
+      }
+
+      if (_embed_data) {
+        emit_data_blob(ofs, output_dir, section.get());
+        continue;
+      }
+
       ofs << ((section->get_flags() & ELFIO::SHF_WRITE) ? "uint8_t g_"
                                                         : "const uint8_t g_");
 
       ofs << name << "_DATA[" << section->get_size() << "] = {" << std::endl;
 
-      ss << "\t";
+      ofs << "\t";
       for (charm::arm::addr_t i = 0; i < section->get_size(); i++) {
-        ss << (data ? static_cast<int>(data[i]) : 0) << ", ";
+        ofs << Dec{data[i]} << ", ";
 
         if (i % 8 == 7) {
-          ss << std::endl;
-          ss << "\t";
+          ofs << "\n\t";
         }
       }
     } else { // for got we map addresses that we know
@@ -324,8 +540,6 @@ void Recompiler::emit_data_source(const std::string &output_dir) {
       ofs << name << "_DATA[" << (section->get_size() / sizeof(arm::instr_t))
           << "] = {" << std::endl;
 
-      ss << std::hex;
-
       // map addresses
       for (arm::addr_t i = 0; i < section->get_size();
            i += sizeof(arm::instr_t)) {
@@ -341,25 +555,65 @@ void Recompiler::emit_data_source(const std::string &output_dir) {
           break;
         }
 
-        ss << "\t0x" << mapped_address << "," << std::endl;
+        ofs << "\t0x" << Hex{mapped_address} << ",\n";
       }
-
-      ss << std::dec;
     }
 
-    ofs << ss.rdbuf() << std::endl << "};" << std::endl;
+    ofs << std::endl << "};" << std::endl;
   }
+
+  ofs.close();
 }
 
-void Recompiler::emit_code_address_mappings(std::ofstream &ofs) {
-  ofs << "inline uint32_t ProgramState::address_map(uintptr_t addr) {"
-      << std::endl;
+// Writes section contents into a .bin file next to data.cpp, which is then
+// included with #embed or, where that isn't supported, .incbin. Compilers
+// handle that much faster than an initializer with a literal for every byte.
+void Recompiler::emit_data_blob(std::ostream &ofs,
+                                const std::string &output_dir,
+                                const ELFIO::section *section) {
+  auto name = symbol_name_map(section->get_name());
+  std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+
+  const bool writable = section->get_flags() & ELFIO::SHF_WRITE;
+  const std::string blob = "g_" + name + "_DATA.bin";
+
+  std::ofstream bin{std::filesystem::path{output_dir} / blob,
+                    std::ios::binary};
+  bin.write(section->get_data(), section->get_size());
+  bin.close();
+
+  if (!bin) {
+    throw std::runtime_error("Unable to write " + blob + "!");
+  }
+
+  ofs << "#ifdef __has_embed" << std::endl;
+  ofs << "alignas(4) " << (writable ? "uint8_t g_" : "const uint8_t g_")
+      << name << "_DATA[" << section->get_size() << "] = {" << std::endl;
+  ofs << "#embed \"" << blob << "\"" << std::endl;
+  ofs << "};" << std::endl;
+  ofs << "#else" << std::endl;
+
+  // globals aren't mangled, so the symbol matches the declaration in data.hpp
+  ofs << "asm(\".section " << (writable ? ".data" : ".rodata") << "\\n\""
+      << std::endl
+      << "\t\".global g_" << name << "_DATA\\n\"" << std::endl
+      << "\t\".type g_" << name << "_DATA, %object\\n\"" << std::endl
+      << "\t\".balign 4\\n\"" << std::endl
+      << "\t\"g_" << name << "_DATA:\\n\"" << std::endl
+      << "\t\".incbin \\\"" << blob << "\\\"\\n\"" << std::endl
+      << "\t\".size g_" << name << "_DATA, " << section->get_size()
+      << "\\n\"" << std::endl
+      << "\t\".previous\");" << std::endl;
+  ofs << "#endif" << std::endl << std::endl;
+}
+
+void Recompiler::emit_code_address_mappings(std::ostream &ofs) {
+  ofs << "uint32_t ProgramState::address_map(uintptr_t addr) {" << std::endl;
 
   ofs << std::hex;
 
   ofs << "\tuint32_t mapped;" << std::endl;
-  ofs << "\tif((mapped = ExecutionState::address_map(addr))) { return mapped; }"
-      << std::endl
+  ofs << "\tif((mapped = memory_map(addr))) { return mapped; }" << std::endl
       << std::endl;
 
   for (auto &section : _elf.sections) {
@@ -381,14 +635,18 @@ void Recompiler::emit_code_address_mappings(std::ofstream &ofs) {
     ofs << "\t}" << std::endl;
   }
 
+  ofs << "\treturn 0;" << std::endl;
   ofs << "}" << std::endl << std::endl;
 
-  ofs << "inline uintptr_t ProgramState::address_resolve(uint32_t addr) {"
+  ofs << "uintptr_t ProgramState::address_resolve(uint32_t addr) {"
       << std::endl;
 
+  // sections are mapped at their guest addresses with fastmem
+  ofs << "#ifdef LIBLAYER_FASTMEM" << std::endl;
+  ofs << "\treturn memory_resolve(addr);" << std::endl;
+  ofs << "#else" << std::endl;
   ofs << "\tuintptr_t mapped;" << std::endl;
-  ofs << "\tif((mapped = ExecutionState::address_resolve(addr))) { return "
-         "mapped; }"
+  ofs << "\tif((mapped = memory_resolve(addr))) { return mapped; }"
       << std::endl
       << std::endl;
 
@@ -410,11 +668,54 @@ void Recompiler::emit_code_address_mappings(std::ofstream &ofs) {
     ofs << "\t}" << std::endl;
   }
 
+  ofs << "\treturn 0;" << std::endl;
+  ofs << "#endif" << std::endl;
+  ofs << "}" << std::endl << std::endl;
+
+  // sections are entered into the page table, so most of the addresses don't
+  // need the checks above. With fastmem they are copied into the guest
+  // address space instead, .bss only needs the pages.
+  ofs << "ProgramState::ProgramState() {" << std::endl;
+  ofs << "#ifndef LIBLAYER_FASTMEM" << std::endl;
+
+  for (auto &section : _elf.sections) {
+    if (!section_is_data(section.get())) {
+      continue;
+    }
+
+    auto name = symbol_name_map(section->get_name());
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+
+    ofs << "\tpages.map(" << name << "_ADDR, " << name << "_SIZE, g_" << name
+        << "_DATA);" << std::endl;
+  }
+
+  ofs << "#else" << std::endl;
+
+  for (auto &section : _elf.sections) {
+    if (!section_is_data(section.get())) {
+      continue;
+    }
+
+    auto name = symbol_name_map(section->get_name());
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+
+    if (section->get_type() == ELFIO::SHT_NOBITS || !section->get_data()) {
+      ofs << "\tfastmem_map(" << name << "_ADDR, " << name << "_SIZE);"
+          << std::endl;
+    } else {
+      ofs << "\tmemcpy(fastmem_map(" << name << "_ADDR, " << name
+          << "_SIZE), g_" << name << "_DATA, " << name << "_SIZE);"
+          << std::endl;
+    }
+  }
+
   ofs << std::dec;
+  ofs << "#endif" << std::endl;
   ofs << "}" << std::endl << std::endl;
 }
 
-void Recompiler::emit_code_stubs(std::ofstream &ofs) {
+void Recompiler::emit_code_stubs(std::ostream &ofs) {
 
   ofs << std::endl
       << MINIFY_COMMENT("/* EXPORTED FUNCTIONS */") << std::endl
@@ -435,6 +736,21 @@ void Recompiler::emit_code_stubs(std::ofstream &ofs) {
     ofs << "}" << std::endl << std::endl;
   }
 
+  ofs << std::endl
+      << MINIFY_COMMENT("/* SLOW PATH */") << std::endl
+      << std::endl;
+
+  // Called when an indirect branch lands on an instruction that isn't a
+  // leader. It returns the address that the execution should continue at.
+  // Such a target is a gap in the leader analysis, so it faults even when
+  // minified, it's weak so that programs can replace it.
+  ofs << "__attribute__((weak)) COLD uint32_t eval_slow_path(ProgramState& "
+         "ps, uint32_t address) {"
+      << std::endl;
+  ofs << "\tliblayer_fault(\"Unknown entry point: \", address);" << std::endl;
+
+  ofs << "}" << std::endl << std::endl;
+
   ofs << std::endl
       << MINIFY_COMMENT("/* DEPENDENCY STUBS */") << std::endl
       << std::endl;
@@ -452,17 +768,67 @@ void Recompiler::emit_code_stubs(std::ofstream &ofs) {
   }
 }
 
-void Recompiler::emit_code_section(std::ofstream &ofs,
-                                   const ELFIO::section *section) {
+void Recompiler::emit_code_dispatcher(std::ostream &ofs) {
+  ofs << std::endl
+      << MINIFY_COMMENT("/* DISPATCHER */") << std::endl
+      << std::endl;
+
+  ofs << "struct FunctionEntry {" << std::endl;
+  ofs << "\tuint32_t start, end;" << std::endl;
+  ofs << "\tuint32_t (*fn)(ProgramState& state, uint32_t address, uint32_t "
+         "ret, uint32_t depth);"
+      << std::endl;
+  ofs << "};" << std::endl << std::endl;
+
+  ofs << "static const FunctionEntry g_functions[] = {" << std::endl;
+  ofs << std::hex;
+
+  for (auto &function : _funs_guest) {
+    ofs << "\t{0x" << function.second.address << ", 0x"
+        << function.second.end << ", f0x" << function.second.address << "},"
+        << std::endl;
+  }
+
+  ofs << std::dec;
+  ofs << "};" << std::endl << std::endl;
+
+  // Functions return the address that execution should continue at whenever
+  // control leaves them, this loop then looks up the function it belongs to.
+  ofs << "void eval(ProgramState& ps, uint32_t address) {" << std::endl;
+  ofs << "\twhile(address != INSTR_RETURN_LR) {" << std::endl;
+  ofs << "\t\tconst FunctionEntry* entry = std::upper_bound(std::begin("
+         "g_functions), std::end(g_functions), address, [](uint32_t addr, "
+         "const FunctionEntry& e) { return addr < e.start; });"
+      << std::endl
+      << std::endl;
+
+  ofs << "\t\tif(UNLIKELY(entry == std::begin(g_functions) || address >= "
+         "(--entry)->end)) {"
+      << std::endl;
+
+  if (_minify) {
+    ofs << "\t\t\t__builtin_unreachable();" << std::endl;
+  } else {
+    ofs << "\t\t\tliblayer_fault(\"Invalid address: \", address);"
+        << std::endl;
+  }
+
+  ofs << "\t\t}" << std::endl << std::endl;
+  ofs << "\t\taddress = entry->fn(ps, address, INSTR_RETURN_LR, 0);"
+      << std::endl;
+  ofs << "\t}" << std::endl;
+  ofs << "}" << std::endl;
+}
+
+void Recompiler::emit_code_section(std::ostream &ofs,
+                                   const ELFIO::section *section,
+                                   arm::addr_t begin, arm::addr_t end) {
   if (!section)
     return;
 
   std::cout << "\tSection " << section->get_name() << " ..." << std::endl;
 
-  const auto data = section->get_data();
-  const auto data_size = section->get_size();
-
-  if (!data) {
+  if (!section->get_data()) {
     return;
   }
 
@@ -471,74 +837,312 @@ void Recompiler::emit_code_section(std::ofstream &ofs,
         << "/* SECTION " << section->get_name() << " */" << std::endl;
   }
 
-  std::stringstream ss;
+  // actual emit, minified by the writer as it goes
+  for (auto &function : _funs_guest) {
+    if (code_section(function.first) != section || function.first < begin ||
+        function.first >= end) {
+      continue;
+    }
+
+    emit_code_function(ofs, section, function.second);
+  }
+}
+
+void Recompiler::emit_code_function(std::ostream &os,
+                                    const ELFIO::section *section,
+                                    const Function &fun) {
+  const auto data = section->get_data();
+  const auto base = static_cast<arm::addr_t>(section->get_address());
+
+  if (!_minify) {
+    os << std::endl << "/* FUNCTION " << fun.name << " */" << std::endl;
+  }
+
+  const Frame *frame = _frames.count(fun.address) ? &_frames[fun.address]
+                                                  : nullptr;
+
+  // spill slots live in locals, relative to SP at function entry. Only the
+  // ones written since they were last in sync (w0x...) go back to memory,
+  // the rest of the frame may not even be set up yet.
+  if (frame) {
+    os << "#undef FRAME_STORE" << std::endl;
+    os << "#undef FRAME_LOAD" << std::endl;
+
+    os << "#define FRAME_STORE()" << std::hex;
+    for (auto slot : frame->slots) {
+      os << " if(w0x" << -slot << ") { ps.mem_write32(frame - 0x" << -slot
+         << ", s0x" << -slot << "); }";
+    }
+
+    os << std::endl << "#define FRAME_LOAD()";
+    for (auto slot : frame->slots) {
+      os << " s0x" << -slot << " = ps.mem_read32(frame - 0x" << -slot
+         << "); w0x" << -slot << " = false;";
+    }
+
+    os << std::dec << std::endl;
+  }
 
-  // actual emit
-  for (arm::addr_t i = 0; i < data_size; i += sizeof(arm::instr_t)) {
-    arm::addr_t addr = static_cast<arm::addr_t>(section->get_address() + i);
+  os << std::hex << "uint32_t f0x" << fun.address
+     << "(ProgramState& state, uint32_t address, uint32_t ret, uint32_t depth) "
+        "{"
+     << std::endl;
+  os << "\tENTER()" << std::endl;
+
+  // entering the function elsewhere than at the start means that the frame
+  // is already set up, with slots in memory
+  if (frame) {
+    std::map<int32_t, std::vector<arm::addr_t>> entries;
+    for (auto &entry : frame->entries) {
+      entries[entry.second].push_back(entry.first);
+    }
+
+    os << std::hex << "\tuint32_t frame = ps.r[REG_SP]";
+    for (auto slot : frame->slots) {
+      os << ", s0x" << -slot << " = 0";
+    }
+
+    os << ";" << std::endl << "\tbool";
+    for (auto slot : frame->slots) {
+      os << (slot == *frame->slots.begin() ? " " : ", ") << "w0x" << -slot
+         << " = false";
+    }
+
+    os << ";" << std::endl;
+    os << "\tif(address != 0x" << fun.address << ") { switch(address) { ";
+
+    for (auto &entry : entries) {
+      for (auto address : entry.second) {
+        os << "case 0x" << address << ": ";
+      }
+
+      os << "frame " << (entry.first < 0 ? "+= 0x" : "-= 0x")
+         << (entry.first < 0 ? -entry.first : entry.first) << "; break; ";
+    }
+
+    os << "} FRAME_LOAD() }" << std::dec << std::endl;
+  }
+
+  os << "\tDISPATCH(0x" << fun.address << ", " << std::dec
+     << (fun.end - fun.address) / sizeof(arm::instr_t) << ",";
+
+  for (arm::addr_t addr = fun.address; addr < fun.end;
+       addr += sizeof(arm::instr_t)) {
+    if (addr == fun.address || _leaders.count(addr)) {
+      os << " L(0x" << Hex{addr} << ")";
+    } else {
+      os << " X";
+    }
+  }
 
-    ss << std::hex << "\tINSTR(0x" << addr << ") {" << std::dec << std::endl;
+  os << ")" << std::endl << std::endl;
+
+  // instructions with the same condition share one `if` block, until flags
+  // or control flow change
+  arm::Condition guard = arm::Condition::AL;
+  auto close_guard = [&]() {
+    if (guard != arm::Condition::AL) {
+      os << "\t\t}" << std::endl;
+      guard = arm::Condition::AL;
+    }
+  };
+
+  for (arm::addr_t addr = fun.address; addr < fun.end;
+       addr += sizeof(arm::instr_t)) {
+    // literal pools can't be executed, nothing jumps or falls into them
+    if (_data_words.count(addr)) {
+      continue;
+    }
 
     arm::instr_t instr_raw;
-    memcpy(&instr_raw, data + i, sizeof(arm::instr_t));
+    memcpy(&instr_raw, data + (addr - base), sizeof(arm::instr_t));
     auto instr = arm::Instruction::decode(instr_raw);
 
+    // constants don't need PC, even if the original instruction reads it
+    const bool reads_pc = instr.reads_pc() && !_constants.count(addr);
+    const auto cond = instr.group == arm::InstructionGroup::INVALID
+                          ? arm::Condition::AL
+                          : instr.cond;
+
+    // only leaders can be entered, the rest is a part of straight-line block
+    if (addr == fun.address || _leaders.count(addr)) {
+      if (addr != fun.address) {
+        close_guard();
+        os << "\t}" << std::endl << std::endl;
+      }
+
+      os << "\tINSTR(0x" << Hex{addr} << ") {" << std::endl;
+    }
+
+    if (cond != guard) {
+      close_guard();
+
+      if (cond != arm::Condition::AL) {
+        os << "\t\tif COND_" << COND_TABLE[(int)cond] << " {" << std::endl;
+        guard = cond;
+      }
+    }
+
+    if (addr != fun.address && !_leaders.count(addr) && !reads_pc) {
+      os << "\t\tTRACK_PC(0x" << Hex{addr} << ")" << std::endl;
+    }
+
+    // PC is only materialized for instructions that read it
+    if (reads_pc) {
+      os << "\t\tSET_PC(0x" << Hex{addr} << ")" << std::endl;
+    }
+
     // debug information for instruction debugging
 
     if (!_minify) {
-      ss << "\t\t" << COND_TABLE[(int)instr.cond] << "(";
-      ss << "DEBUG_LOG(\"0x" << std::hex << addr << ": ";
-      instr.dump(ss);
-      ss << "\"));" << std::endl;
+      os << "\t\tDEBUG_LOG(\"0x" << std::hex << addr << ": ";
+      instr.dump(os);
+      os << "\");" << std::endl;
     }
 
     // now actual instruction
-    emit_code_arm(ss, instr, addr);
+    emit_code_arm(os, instr, addr, fun);
 
-    ss << "\t\t[[fallthrough]];" << std::endl
-       << "\t}" << std::endl
-       << std::endl;
+    // the next instruction has to check flags again
+    if (instr.set_cond || instr.writes_pc() ||
+        instr.group == arm::InstructionGroup::SWI) {
+      close_guard();
+    }
   }
 
-  if (_minify) {
-    std::string minimized_ss = ss.str();
-    minimized_ss.erase(
-        std::remove_if(minimized_ss.begin(), minimized_ss.end(),
-                       [](char c) { return isspace(c) && c != ' '; }),
-        minimized_ss.end());
+  // the last instruction continues into the next function
+  close_guard();
+  os << "\t}" << std::endl << std::endl;
+  os << "\tSTORE() return 0x" << std::hex << fun.end << std::dec << ";"
+     << std::endl
+     << std::endl;
+
+  // addresses outside of this function are handled by the dispatcher, the
+  // ones that are inside, but aren't leaders, go to the slow path
+  os << "__exit__:" << std::endl;
+  os << std::hex << "\tif(UNLIKELY(address >= 0x" << fun.address
+     << " && address < 0x" << fun.end << ")) {" << std::dec << std::endl;
+  os << "\t\tSTORE() return eval_slow_path(state, address);" << std::endl;
+  os << "\t}" << std::endl << std::endl;
+  os << "\tSTORE() return address;" << std::endl;
+  os << "}" << std::endl;
+
+  if (frame) {
+    os << "#undef FRAME_STORE" << std::endl;
+    os << "#undef FRAME_LOAD" << std::endl;
+    os << "#define FRAME_STORE()" << std::endl;
+    os << "#define FRAME_LOAD()" << std::endl;
+  }
+}
 
-    ofs << minimized_ss;
-  } else {
-    ofs << ss.rdbuf();
+// Whether the address has an INSTR() label in the emitted function, only
+// leaders do.
+bool Recompiler::has_label(arm::addr_t address, const Function &fun) {
+  return address >= fun.address && address < fun.end &&
+         (address == fun.address || _leaders.count(address));
+}
+
+// Returns FLAG_* mask of flags the instruction has to compute, the rest of
+// them is never read (see analyze_flags).
+std::string Recompiler::code_flags(const arm::Instruction &instr,
+                                   arm::addr_t address) {
+  uint8_t flags = instr.set_cond ? FLAGS_ALL : 0;
+  if (_flags_live.count(address)) {
+    flags = _flags_live[address];
   }
+
+  if (!flags || flags == FLAGS_ALL) {
+    return flags ? "FLAGS_ALL" : "0";
+  }
+
+  std::string result;
+  for (auto &flag : {std::make_pair(FLAG_N, "FLAG_N"),
+                     std::make_pair(FLAG_Z, "FLAG_Z"),
+                     std::make_pair(FLAG_C, "FLAG_C"),
+                     std::make_pair(FLAG_V, "FLAG_V")}) {
+    if (flags & flag.first) {
+      result += result.empty() ? flag.second : std::string{"|"} + flag.second;
+    }
+  }
+
+  return result;
 }
 
 void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
-                               arm::addr_t address) {
+                               arm::addr_t address, const Function &fun) {
   if (instr.group == arm::InstructionGroup::INVALID) {
     if (_minify) {
       os << "\t\t__builtin_unreachable();";
     } else {
-      os << "\t\tthrow std::runtime_error(\"Illegal instruction at 0x"
+      os << "\t\tliblayer_fault(\"Illegal instruction at 0x"
          << std::hex << address << std::dec << "\");";
     }
+
+    os << std::endl;
+    return;
+  }
+
+  os << "\t\t";
+
+  // known cases of a jump table jump directly, the rest falls trough to the
+  // instruction itself
+  if (_jump_tables.count(address)) {
+    const auto &table = _jump_tables[address];
+    os << "switch(ps.r[" << REGISTER_TABLE[(int)table.index] << "]) { ";
+
+    for (size_t i = 0; i < table.targets.size(); i++) {
+      arm::addr_t target = table.targets[i];
+      os << "case " << i << ": " << std::hex;
+
+      if (has_label(target, fun)) {
+        os << "goto a0x" << target << "; ";
+      } else {
+        os << "STORE() return 0x" << target << "; ";
+      }
+
+      os << std::dec;
+    }
+
+    os << "default: break; } ";
+  }
+
+  // value is known at recompile time (see analyze_constants)
+  if (_constants.count(address)) {
+    const auto &constant = _constants[address];
+    os << "ps.r[" << REGISTER_TABLE[(int)constant.rd] << "] = 0x" << std::hex
+       << constant.value << std::dec << ";" << MINIFY_COMMENT(" /* constant */")
+       << std::endl;
     return;
   }
 
-  os << "\t\t" << COND_TABLE[(int)instr.cond] << "(";
+  // spill slot kept in a local (see analyze_frames)
+  if (_slot_accesses.count(address)) {
+    const auto rd = REGISTER_TABLE[(int)instr.data_trans.rd];
+    const auto slot = -_slot_accesses[address];
+
+    if (instr.data_trans.load) {
+      os << "ps.r[" << rd << "] = s0x" << std::hex << slot << std::dec << ";";
+    } else {
+      os << "s0x" << std::hex << slot << " = ps.r[" << rd << "]; w0x" << slot
+         << std::dec << " = true;";
+    }
+
+    os << MINIFY_COMMENT(" /* spill slot */") << std::endl;
+    return;
+  }
 
   switch (instr.group) {
   case arm::InstructionGroup::DATA_PROCESSING: {
     if (instr.is_imm) {
-      os << OPCODE_TABLE[(int)instr.data.op] << "("
-         << (instr.set_cond ? "true" : "false")
+      os << OPCODE_TABLE[(int)instr.data.op] << "<"
+         << code_flags(instr, address)
          << MINIFY_COMMENT_COMMA(" /* set_cond */, ")
 
          << REGISTER_TABLE[(int)instr.data.rd]
          << MINIFY_COMMENT_COMMA(" /* rd */, ")
 
-         << REGISTER_TABLE[(int)instr.data.rn]
-         << MINIFY_COMMENT_COMMA(" /* rn */, ")
+         << REGISTER_TABLE[(int)instr.data.rn] << MINIFY_COMMENT(" /* rn */")
+         << ">("
 
          << "0x" << std::hex << instr.data.op2_imm << std::dec
          << MINIFY_COMMENT(" /* op2_imm */") << ");";
@@ -546,15 +1150,15 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
     }
 
     if (instr.data.op2_reg.is_reg) {
-      os << OPCODE_TABLE[(int)instr.data.op] << "("
-         << (instr.set_cond ? "true" : "false")
+      os << OPCODE_TABLE[(int)instr.data.op] << "<"
+         << code_flags(instr, address)
          << MINIFY_COMMENT_COMMA(" /* set_cond */, ")
 
          << REGISTER_TABLE[(int)instr.data.rd]
          << MINIFY_COMMENT_COMMA(" /* rd */, ")
 
-         << REGISTER_TABLE[(int)instr.data.rn]
-         << MINIFY_COMMENT_COMMA(" /* rn */, ")
+         << REGISTER_TABLE[(int)instr.data.rn] << MINIFY_COMMENT(" /* rn */")
+         << ">("
 
          << SHIFT_TABLE[(int)instr.data.op2_reg.type] << "(ps.r["
 
@@ -565,15 +1169,15 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
          << "]" << MINIFY_COMMENT(" /* rs */") << "));";
 
     } else {
-      os << OPCODE_TABLE[(int)instr.data.op] << "("
-         << (instr.set_cond ? "true" : "false")
+      os << OPCODE_TABLE[(int)instr.data.op] << "<"
+         << code_flags(instr, address)
          << MINIFY_COMMENT_COMMA(" /* set_cond */, ")
 
          << REGISTER_TABLE[(int)instr.data.rd]
          << MINIFY_COMMENT_COMMA(" /* rd */, ")
 
-         << REGISTER_TABLE[(int)instr.data.rn]
-         << MINIFY_COMMENT_COMMA(" /* rn */, ")
+         << REGISTER_TABLE[(int)instr.data.rn] << MINIFY_COMMENT(" /* rn */")
+         << ">("
 
          << SHIFT_TABLE[(int)instr.data.op2_reg.type] << "(ps.r["
 
@@ -601,7 +1205,7 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
 
     default: {
       os << " address = " << std::hex << "ps.r[" << REGISTER_TABLE[REG_PC]
-         << "]; goto __start__;";
+         << "]; " << (instr.is_return() ? "RETURN()" : "goto __start__;");
 
       os << MINIFY_COMMENT(" /* this instruction modifies pc */");
       break;
@@ -612,8 +1216,8 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
   }
 
   case arm::InstructionGroup::MULTIPLY:
-    os << (instr.mul.accumulate ? "ps.arm_mla" : "ps.arm_mul") << "("
-       << (instr.set_cond ? "true" : "false")
+    os << (instr.mul.accumulate ? "ps.arm_mla" : "ps.arm_mul") << "<"
+       << code_flags(instr, address)
        << MINIFY_COMMENT_COMMA(" /* set_cond */, ")
 
        << REGISTER_TABLE[(int)instr.mul.rd]
@@ -626,12 +1230,12 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
        << MINIFY_COMMENT_COMMA(" /* rs */, ")
 
        << REGISTER_TABLE[(int)instr.mul.rm] << MINIFY_COMMENT(" /* rm */")
-       << ")";
+       << ">()";
     break;
 
   case arm::InstructionGroup::MULTIPLY_LONG:
-    os << (instr.mul_long.accumulate ? "ps.arm_mlal" : "ps.arm_mull") << "("
-       << (instr.set_cond ? "true" : "false")
+    os << (instr.mul_long.accumulate ? "ps.arm_mlal" : "ps.arm_mull") << "<"
+       << code_flags(instr, address)
        << MINIFY_COMMENT_COMMA(" /* set_cond */, ")
 
        << (instr.mul_long.sign ? "true" : "false")
@@ -647,46 +1251,26 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
        << MINIFY_COMMENT_COMMA(" /* rm */, ")
 
        << REGISTER_TABLE[(int)instr.mul_long.rs] << MINIFY_COMMENT(" /* rs */")
-       << ")";
+       << ">()";
     break;
 
   case arm::InstructionGroup::BRANCH: {
-    uint32_t final_offset = (int64_t)(address + 8) + instr.branch.offset;
     Function *mapped = nullptr;
+    arm::addr_t final_offset = branch_target(instr, address, mapped);
 
     // maybe we are calling external fn
-    if (_fun_deps_mapped.count(final_offset)) {
-      mapped = _fun_deps_mapped[final_offset];
-
-      if (mapped->is_external) {
-        os << "external_" << mapped->name << "(ps)";
+    if (mapped && mapped->is_external) {
+      os << "SET_PC(0x" << std::hex << address << std::dec
+         << ") STORE() external_" << mapped->name << "(state); LOAD()";
 
-        if (!instr.branch.link) {
-          os << MINIFY_COMMENT(" /* b, not bl */");
-        }
-
-        break;
+      if (!instr.branch.link) {
+        os << MINIFY_COMMENT(" /* b, not bl */");
       }
 
-      final_offset = mapped->address;
-    }
-
-    bool found_section = false;
-    for (auto &section : _elf.sections) {
-      if (!section_is_code(section.get())) {
-        continue;
-      }
-
-      if (final_offset < section->get_address() ||
-          final_offset >= section->get_address() + section->get_size()) {
-        continue;
-      }
-
-      found_section = true;
       break;
     }
 
-    if (!found_section) {
+    if (!code_section(final_offset)) {
       emit_code_invalid(os, instr, address,
                         "Attempt to branch to an invalid address: 0x%x",
                         final_offset);
@@ -698,7 +1282,21 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
          << std::dec << "; ";
     }
 
-    os << "goto a0x" << std::hex << final_offset << std::dec;
+    // calls continue with the next instruction once the callee returns
+    if (instr.branch.link && _funs_guest.count(final_offset)) {
+      os << std::hex << "CALL(f0x" << final_offset << ", 0x" << final_offset
+         << ", 0x" << address + sizeof(uint32_t) << ")" << std::dec;
+    } else if (_tail_calls.count(address)) {
+      os << std::hex << "TAIL_CALL(f0x" << final_offset << ", 0x"
+         << final_offset << ")" << std::dec;
+    } else if (has_label(final_offset, fun)) {
+      // branches within the function are local, the rest goes trough
+      // dispatcher (which also handles targets without a label, e.g. in
+      // words that analyze_data found to be data)
+      os << "goto a0x" << std::hex << final_offset << std::dec;
+    } else {
+      os << "STORE() return 0x" << std::hex << final_offset << std::dec;
+    }
 
     if (!_minify && mapped) {
       os << " /* ref: " << mapped->name << " */";
@@ -709,7 +1307,8 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
 
   case arm::InstructionGroup::BRANCH_EXCHANGE:
     os << "address = " << std::hex << "ps.r["
-       << REGISTER_TABLE[(int)instr.branchex.rm] << "]; goto __start__; "
+       << REGISTER_TABLE[(int)instr.branchex.rm] << "]; "
+       << (instr.is_return() ? "RETURN() " : "goto __start__; ")
        << MINIFY_COMMENT("/* bx */");
     break;
 
@@ -718,7 +1317,7 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
     break;
 
   case arm::InstructionGroup::SINGLE_DATA_TRANSFER:
-    os << (instr.data_trans.load ? "ps.arm_ldr(" : "ps.arm_str(")
+    os << (instr.data_trans.load ? "ps.arm_ldr<" : "ps.arm_str<")
 
        << (instr.data_trans.pre_indx ? "true" : "false")
        << MINIFY_COMMENT_COMMA(" /* pre_indx */, ")
@@ -736,7 +1335,7 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
        << MINIFY_COMMENT_COMMA(" /* rn */, ")
 
        << REGISTER_TABLE[(int)instr.data_trans.rd]
-       << MINIFY_COMMENT_COMMA(" /* rd */, ");
+       << MINIFY_COMMENT(" /* rd */") << ">(";
 
     os << std::hex;
 
@@ -764,8 +1363,7 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
       }
     }
 
-    os << std::dec;
-    os << ", true" << MINIFY_COMMENT(" /* copy */") << ");";
+    os << std::dec << ");";
 
     if (instr.data_trans.load) {
       if (instr.data_trans.rd != arm::Register::PC) {
@@ -773,7 +1371,7 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
       }
 
       os << " address = " << std::hex << "ps.r[" << REGISTER_TABLE[REG_PC]
-         << "]; goto __start__;";
+         << "]; " << (instr.is_return() ? "RETURN()" : "goto __start__;");
 
       os << MINIFY_COMMENT(" /* this instruction modifies pc */");
     }
@@ -781,7 +1379,7 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
     break;
 
   case arm::InstructionGroup::BLOCK_DATA_TRANSFER: {
-    os << (instr.blk_data_trans.load ? "ps.arm_ldm(" : "ps.arm_stm(")
+    os << (instr.blk_data_trans.load ? "ps.arm_ldm<" : "ps.arm_stm<")
        << (instr.blk_data_trans.pre_indx ? "true" : "false")
        << MINIFY_COMMENT_COMMA(" /* pre_indx */, ")
 
@@ -795,8 +1393,7 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
        << MINIFY_COMMENT_COMMA(" /* rn */, ") << std::hex << "0x"
 
        << instr.blk_data_trans.reg_list << std::dec
-       << MINIFY_COMMENT_COMMA(" /* reg_list */, ") << "true"
-       << MINIFY_COMMENT(" /* copy */") << ");";
+       << MINIFY_COMMENT(" /* reg_list */") << ">();";
 
     if (instr.blk_data_trans.load) {
       if (!((instr.blk_data_trans.reg_list >> REG_PC) & 1)) {
@@ -804,7 +1401,7 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
       }
 
       os << " address = " << std::hex << "ps.r[" << REGISTER_TABLE[REG_PC]
-         << "]; goto __start__;";
+         << "]; " << (instr.is_return() ? "RETURN()" : "goto __start__;");
 
       os << MINIFY_COMMENT(" /* this instruction modifies pc */");
     }
@@ -813,7 +1410,7 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
   }
 
   case arm::InstructionGroup::HALFWORD_DATA_TRANSFER:
-    os << (instr.hw_data_trans.load ? "ps.arm_ldrh(" : "ps.arm_strh(")
+    os << (instr.hw_data_trans.load ? "ps.arm_ldrh<" : "ps.arm_strh<")
        << (instr.hw_data_trans.pre_indx ? "true" : "false")
        << MINIFY_COMMENT_COMMA(" /* pre_indx */, ")
 
@@ -830,13 +1427,13 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
        << MINIFY_COMMENT_COMMA(" /* rd */, ")
 
        << "0x" << std::hex << (int)instr.hw_data_trans.type
-       << MINIFY_COMMENT_COMMA(" /* type */, ");
+       << MINIFY_COMMENT(" /* type */") << ">(";
 
     if (instr.is_imm) {
       os << "0x" << (int)instr.hw_data_trans.offset_imm
          << MINIFY_COMMENT(" /* offset */");
     } else {
-      os << REGISTER_TABLE[(int)instr.hw_data_trans.rm]
+      os << "ps.r[" << REGISTER_TABLE[(int)instr.hw_data_trans.rm] << "]"
          << MINIFY_COMMENT(" /* rm */");
     }
 
@@ -854,10 +1451,10 @@ void Recompiler::emit_code_arm(std::ostream &os, const arm::Instruction &instr,
     break;
   }
 
-  os << ");" << std::endl;
+  os << ";" << std::endl;
 }
 
-inline std::string symbol_name_map(const std::string &symbol) {
+std::string symbol_name_map(const std::string &symbol) {
   std::string s;
 
   for (auto &ch : symbol) {
@@ -876,7 +1473,7 @@ inline std::string symbol_name_map(const std::string &symbol) {
   return s;
 }
 
-inline bool section_is_data(const ELFIO::section *section) {
+bool section_is_data(const ELFIO::section *section) {
   auto flags = section->get_flags();
   if (!(flags & ELFIO::SHF_ALLOC) && !(flags & ELFIO::SHF_EXECINSTR)) {
     return false;
@@ -903,7 +1500,7 @@ inline bool section_is_data(const ELFIO::section *section) {
   return true;
 }
 
-inline bool section_is_code(const ELFIO::section *section) {
+bool section_is_code(const ELFIO::section *section) {
   if (!(section->get_flags() & ELFIO::SHF_EXECINSTR)) {
     return false;
   }
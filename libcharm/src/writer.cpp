@@ -0,0 +1,140 @@
+#include "libcharm/writer.hpp"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+
+#define WRITER_BUFFER_SIZE (1024 * 1024 * 4) // Flushed once full (4 MB)
+
+namespace charm::recomp {
+
+WriterBuffer::WriterBuffer(const std::filesystem::path &path, bool minify)
+    : _path(path), _file(path, std::ios::binary), _buffer(WRITER_BUFFER_SIZE),
+      _minify(minify) {
+  if (!_file) {
+    throw std::runtime_error("Unable to open " + path.string() + "!");
+  }
+}
+
+// only reached without close() when emitting failed, whatever was written
+// so far is kept without checking
+WriterBuffer::~WriterBuffer() {
+  if (_file.is_open()) {
+    _file.write(_buffer.data(), _used);
+  }
+}
+
+void WriterBuffer::close() {
+  flush_buffer();
+  _file.close();
+
+  if (!_file) {
+    throw std::runtime_error("Unable to write " + _path.string() + "!");
+  }
+}
+
+WriterBuffer::int_type WriterBuffer::overflow(int_type ch) {
+  if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+    put(traits_type::to_char_type(ch));
+  }
+
+  return traits_type::not_eof(ch);
+}
+
+std::streamsize WriterBuffer::xsputn(const char *s, std::streamsize n) {
+  if (_minify) {
+    for (std::streamsize i = 0; i < n; i++) {
+      put(s[i]);
+    }
+
+    return n;
+  }
+
+  // copy straight into the buffer, in as many pieces as it takes
+  std::streamsize left = n;
+  while (left > 0) {
+    if (_used == _buffer.size()) {
+      flush_buffer();
+    }
+
+    const size_t count =
+        std::min(static_cast<size_t>(left), _buffer.size() - _used);
+    memcpy(&_buffer[_used], s, count);
+    _used += count;
+    s += count;
+    left -= count;
+  }
+
+  return n;
+}
+
+// the buffer is only written once it's full or the file is closed
+int WriterBuffer::sync() { return 0; }
+
+void WriterBuffer::put(char c) {
+  if (_minify) {
+    // directives have to start on a new line and end with one
+    if (_line_start && c == '#') {
+      _directive = true;
+
+      if (!_out_line_start) {
+        put_raw('\n');
+      }
+    }
+
+    _line_start = c == '\n';
+
+    if (c == '\n') {
+      if (!_directive) {
+        return;
+      }
+
+      _directive = false;
+    } else if (c != ' ' && isspace(static_cast<unsigned char>(c))) {
+      return;
+    }
+  }
+
+  put_raw(c);
+}
+
+void WriterBuffer::put_raw(char c) {
+  if (_used == _buffer.size()) {
+    flush_buffer();
+  }
+
+  _buffer[_used++] = c;
+  _out_line_start = c == '\n';
+}
+
+void WriterBuffer::flush_buffer() {
+  _file.write(_buffer.data(), _used);
+  _used = 0;
+
+  if (!_file) {
+    throw std::runtime_error("Unable to write " + _path.string() + "!");
+  }
+}
+
+Writer::Writer(const std::filesystem::path &path, bool minify)
+    : std::ostream(nullptr), _buffer(path, minify) {
+  rdbuf(&_buffer);
+  exceptions(std::ios::badbit);
+}
+
+void Writer::close() { _buffer.close(); }
+
+std::ostream &operator<<(std::ostream &os, Hex hex) {
+  char buffer[16];
+  auto result = std::to_chars(buffer, buffer + sizeof(buffer), hex.value, 16);
+  return os.write(buffer, result.ptr - buffer);
+}
+
+std::ostream &operator<<(std::ostream &os, Dec dec) {
+  char buffer[24];
+  auto result = std::to_chars(buffer, buffer + sizeof(buffer), dec.value);
+  return os.write(buffer, result.ptr - buffer);
+}
+
+} // namespace charm::recomp
@@ -0,0 +1,209 @@
+// Stress test and benchmark of the liblayer heap (Memory::memory_alloc & co).
+//
+//   heap-bench stress [ops]  random alloc/calloc/realloc/free with checks
+//   heap-bench bench [ops]   random alloc/free and realloc mixes, compared
+//                            with the host allocator
+//
+// Define LIBLAYER_FASTMEM to run it on the fastmem address space.
+#define LIBLAYER_IMPL
+#include <liblayer/liblayer.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#define BENCH_SLOTS (4096) // Live allocations at most
+#define BENCH_SEED (42)
+
+struct HeapState : public BasicExecutionState<HeapState> {};
+
+// Allocator under test, either the guest heap or the host one
+struct GuestHeap {
+  HeapState &state;
+
+  void *alloc(uint32_t size) { return state.memory_alloc(size); }
+  void *realloc(void *p, uint32_t size) {
+    return state.memory_realloc(p, size);
+  }
+  void free(void *p) { state.memory_free(p); }
+};
+
+struct HostHeap {
+  void *alloc(uint32_t size) { return ::malloc(size); }
+  void *realloc(void *p, uint32_t size) { return ::realloc(p, size); }
+  void free(void *p) { ::free(p); }
+};
+
+struct Allocation {
+  uint8_t *p;
+  uint32_t size;
+  uint8_t tag;
+};
+
+static void fail(const char *message) {
+  fprintf(stderr, "stress: %s\n", message);
+  exit(EXIT_FAILURE);
+}
+
+static void check(const Allocation &a, uint32_t size) {
+  for (uint32_t i = 0; i < size; i++) {
+    if (a.p[i] != a.tag) {
+      fail("allocation was overwritten");
+    }
+  }
+}
+
+static int stress(HeapState &state, size_t ops) {
+  std::mt19937 rng(BENCH_SEED);
+  std::vector<Allocation> live;
+  size_t failed = 0;
+
+  for (size_t i = 0; i < ops; i++) {
+    const uint32_t op = rng() % 10;
+
+    if (op < 4 || live.empty()) {
+      // mostly small, sometimes up to 64 KB
+      const uint32_t size =
+          rng() % 8 ? rng() % 256 + 1 : rng() % (64 * 1024) + 1;
+      auto *p = static_cast<uint8_t *>(op == 0 ? state.memory_calloc(size, 1)
+                                               : state.memory_alloc(size));
+
+      if (!p) {
+        failed++;
+        continue;
+      }
+
+      if (reinterpret_cast<uintptr_t>(p) % 8) {
+        fail("allocation isn't 8-byte aligned");
+      }
+
+      if (op == 0 && std::any_of(p, p + size, [](uint8_t b) { return b; })) {
+        fail("calloc returned dirty memory");
+      }
+
+      const Allocation a = {p, size, static_cast<uint8_t>(rng())};
+      memset(a.p, a.tag, a.size);
+      live.push_back(a);
+    } else if (op < 8) {
+      const size_t index = rng() % live.size();
+      check(live[index], live[index].size);
+
+      state.memory_free(live[index].p);
+      live[index] = live.back();
+      live.pop_back();
+    } else {
+      Allocation &a = live[rng() % live.size()];
+      const uint32_t size = rng() % 4096 + 1;
+      auto *p = static_cast<uint8_t *>(state.memory_realloc(a.p, size));
+
+      if (!p) {
+        failed++;
+        continue;
+      }
+
+      a.p = p;
+      check(a, std::min(size, a.size));
+
+      a.size = size;
+      memset(a.p, a.tag, a.size);
+    }
+  }
+
+  for (auto &a : live) {
+    check(a, a.size);
+    state.memory_free(a.p);
+  }
+
+  // with everything freed, the heap has to be one block again
+  void *all = state.memory_alloc(LIBLAYER_MEMORY_SIZE / 16 * 15);
+  if (!all) {
+    fail("free blocks weren't merged");
+  }
+
+  state.memory_free(all);
+
+  printf("stress: %zu ops, %zu failed allocations, ok\n", ops, failed);
+  return EXIT_SUCCESS;
+}
+
+// Returns ns per operation
+template <typename Heap> static double bench_mix(Heap heap, size_t ops) {
+  std::mt19937 rng(BENCH_SEED);
+  std::vector<void *> slots(BENCH_SLOTS, nullptr);
+
+  const auto start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < ops; i++) {
+    void *&slot = slots[rng() % slots.size()];
+
+    if (slot) {
+      heap.free(slot);
+      slot = nullptr;
+    } else {
+      slot = heap.alloc(16 + rng() % 1024);
+    }
+  }
+
+  const auto end = std::chrono::steady_clock::now();
+
+  for (void *slot : slots) {
+    heap.free(slot);
+  }
+
+  return std::chrono::duration<double, std::nano>(end - start).count() / ops;
+}
+
+template <typename Heap> static double bench_realloc(Heap heap, size_t ops) {
+  std::mt19937 rng(BENCH_SEED);
+  std::vector<void *> slots(BENCH_SLOTS, nullptr);
+
+  const auto start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < ops; i++) {
+    void *&slot = slots[rng() % slots.size()];
+    slot = heap.realloc(slot, 16 + rng() % 2048);
+  }
+
+  const auto end = std::chrono::steady_clock::now();
+
+  for (void *slot : slots) {
+    heap.free(slot);
+  }
+
+  return std::chrono::duration<double, std::nano>(end - start).count() / ops;
+}
+
+static int bench(HeapState &state, size_t ops) {
+  printf("bench: %zu ops, %d slots\n", ops, BENCH_SLOTS);
+  printf("\talloc/free  guest %7.1f ns/op, host %7.1f ns/op\n",
+         bench_mix(GuestHeap{state}, ops), bench_mix(HostHeap{}, ops));
+  printf("\trealloc     guest %7.1f ns/op, host %7.1f ns/op\n",
+         bench_realloc(GuestHeap{state}, ops), bench_realloc(HostHeap{}, ops));
+
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s stress|bench [ops]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const size_t ops = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1000000;
+
+  // too big for the stack
+  auto state = std::make_unique<HeapState>();
+
+  if (!strcmp(argv[1], "stress")) {
+    return stress(*state, ops);
+  } else if (!strcmp(argv[1], "bench")) {
+    return bench(*state, ops);
+  }
+
+  fprintf(stderr, "unknown mode %s\n", argv[1]);
+  return EXIT_FAILURE;
+}
@@ -5,8 +5,6 @@
 #include <iomanip>
 #include <stdexcept>
 
-#define UNLIKELY(x) __builtin_expect(!!(x), 0)
-
 constexpr inline reg_value_t op2_lsl(reg_value_t value, reg_value_t amount) {
   if (!amount)
     return value;
@@ -41,302 +39,315 @@ constexpr inline reg_value_t op2_ror(reg_value_t value, reg_value_t amount) {
   return (value >> amount) | (value << (32 - amount));
 }
 
-inline void ExecutionState::arm_add(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_add(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_add: before r" << static_cast<int>(rd) << "=" << r[rd] << ", r"
                                 << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm);
 
-  if (s) {
-    cs = __builtin_add_overflow(r[rn], imm, &r[rd]);
+  reg_value_t result;
+  bool carry = __builtin_add_overflow(r[rn], imm, &result);
+
+  if (s & FLAG_C)
+    cs = carry;
+  if (s & FLAG_V) {
     int32_t unused;
     vs = __builtin_sadd_overflow(r[rn], imm, &unused);
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  } else {
-    r[rd] = r[rn] + imm;
   }
+  update_nz(s, result);
+  r[rd] = result;
 
   DEBUG_LOG("arm_add: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_adc(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_adc(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_adc: before r" << static_cast<int>(rd) << "=" << r[rd] << ", r"
                                 << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm << ", cs=" << cs);
 
   reg_value_t operand = imm + cs;
-  if (s) {
-    cs = __builtin_add_overflow(r[rn], operand, &r[rd]);
+  reg_value_t result;
+  bool carry = __builtin_add_overflow(r[rn], operand, &result);
+
+  if (s & FLAG_C)
+    cs = carry;
+  if (s & FLAG_V) {
     int32_t unused;
     vs = __builtin_sadd_overflow(r[rn], operand, &unused);
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  } else {
-    r[rd] = r[rn] + operand;
   }
+  update_nz(s, result);
+  r[rd] = result;
 
   DEBUG_LOG("arm_adc: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_sub(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_sub(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_sub: before r" << static_cast<int>(rd) << "=" << r[rd] << ", r"
                                 << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm);
 
-  if (s) {
-    cs = !__builtin_sub_overflow(r[rn], imm, &r[rd]);
+  reg_value_t result;
+  bool borrow = __builtin_sub_overflow(r[rn], imm, &result);
+
+  if (s & FLAG_C)
+    cs = !borrow;
+  if (s & FLAG_V) {
     int32_t unused;
     vs = __builtin_ssub_overflow(r[rn], imm, &unused);
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  } else {
-    r[rd] = r[rn] - imm;
   }
+  update_nz(s, result);
+  r[rd] = result;
 
   DEBUG_LOG("arm_sub: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_sbc(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_sbc(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_sbc: before r" << static_cast<int>(rd) << "=" << r[rd] << ", r"
                                 << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm << ", cs=" << cs);
 
   reg_value_t operand = imm + !cs;
-  if (s) {
-    cs = !__builtin_sub_overflow(r[rn], operand, &r[rd]);
+  reg_value_t result;
+  bool borrow = __builtin_sub_overflow(r[rn], operand, &result);
+
+  if (s & FLAG_C)
+    cs = !borrow;
+  if (s & FLAG_V) {
     int32_t unused;
     vs = __builtin_ssub_overflow(r[rn], operand, &unused);
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  } else {
-    r[rd] = r[rn] - operand;
   }
+  update_nz(s, result);
+  r[rd] = result;
 
   DEBUG_LOG("arm_sbc: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_cmp(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_cmp(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_cmp: before r" << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm);
 
-  uint32_t result;
-  cs = !__builtin_sub_overflow(r[rn], imm, &result);
-  int32_t unused;
-  vs = __builtin_ssub_overflow(r[rn], imm, &unused);
-  mi = (result >> 31) & 1;
-  z = !result;
+  reg_value_t result;
+  bool borrow = __builtin_sub_overflow(r[rn], imm, &result);
+
+  if (s & FLAG_C)
+    cs = !borrow;
+  if (s & FLAG_V) {
+    int32_t unused;
+    vs = __builtin_ssub_overflow(r[rn], imm, &unused);
+  }
+  update_nz(s, result);
 
   DEBUG_LOG("arm_cmp: result=" << result << " (flags: N=" << mi << ", Z=" << z
                                << ", C=" << cs << ", V=" << vs << ")");
 }
 
-inline void ExecutionState::arm_mov(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_mov(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_mov: before r" << static_cast<int>(rd) << "=" << r[rd]
                                 << ", imm=" << imm);
 
   r[rd] = imm;
-  if (s) {
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  }
+  update_nz(s, r[rd]);
 
   DEBUG_LOG("arm_mov: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_rsb(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_rsb(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_rsb: before r" << static_cast<int>(rd) << "=" << r[rd] << ", r"
                                 << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm);
 
-  if (s) {
-    cs = !__builtin_sub_overflow(imm, r[rn], &r[rd]);
+  reg_value_t result;
+  bool borrow = __builtin_sub_overflow(imm, r[rn], &result);
+
+  if (s & FLAG_C)
+    cs = !borrow;
+  if (s & FLAG_V) {
     int32_t unused;
     vs = __builtin_ssub_overflow(imm, r[rn], &unused);
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  } else {
-    r[rd] = imm - r[rn];
   }
+  update_nz(s, result);
+  r[rd] = result;
 
   DEBUG_LOG("arm_rsb: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_rsc(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_rsc(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_rsc: before r" << static_cast<int>(rd) << "=" << r[rd] << ", r"
                                 << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm << ", cs=" << cs);
 
   reg_value_t operand = r[rn] + !cs;
 
-  if (s) {
-    cs = !__builtin_sub_overflow(imm, operand, &r[rd]);
+  reg_value_t result;
+  bool borrow = __builtin_sub_overflow(imm, operand, &result);
+
+  if (s & FLAG_C)
+    cs = !borrow;
+  if (s & FLAG_V) {
     int32_t unused;
     vs = __builtin_ssub_overflow(imm, operand, &unused);
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  } else {
-    r[rd] = imm - operand;
   }
+  update_nz(s, result);
+  r[rd] = result;
 
   DEBUG_LOG("arm_rsc: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_and(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_and(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_and: before r" << static_cast<int>(rd) << "=" << r[rd] << ", r"
                                 << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm);
   r[rd] = r[rn] & imm;
 
-  if (s) {
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  }
+  update_nz(s, r[rd]);
 
   DEBUG_LOG("arm_and: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_eor(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_eor(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_eor: before r" << static_cast<int>(rd) << "=" << r[rd] << ", r"
                                 << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm);
   r[rd] = r[rn] ^ imm;
 
-  if (s) {
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  }
+  update_nz(s, r[rd]);
 
   DEBUG_LOG("arm_eor: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_orr(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_orr(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_orr: before r" << static_cast<int>(rd) << "=" << r[rd] << ", r"
                                 << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm);
   r[rd] = r[rn] | imm;
-  if (s) {
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  }
+  update_nz(s, r[rd]);
 
   DEBUG_LOG("arm_orr: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_bic(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_bic(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_bic: before r" << static_cast<int>(rd) << "=" << r[rd] << ", r"
                                 << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm);
   r[rd] = r[rn] & ~imm;
 
-  if (s) {
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  }
+  update_nz(s, r[rd]);
 
   DEBUG_LOG("arm_bic: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_mvn(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_mvn(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_mvn: before r" << static_cast<int>(rd) << "=" << r[rd]
                                 << ", imm=" << imm);
   r[rd] = ~imm;
 
-  if (s) {
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  }
+  update_nz(s, r[rd]);
 
   DEBUG_LOG("arm_mvn: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_tst(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_tst(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_tst: before r" << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm);
 
   reg_value_t result = r[rn] & imm;
-  mi = (result >> 31) & 1;
-  z = !result;
+  update_nz(s, result);
 
   DEBUG_LOG("arm_tst: result=" << result << " (flags: N=" << mi << ", Z=" << z
                                << ")");
 }
 
-inline void ExecutionState::arm_teq(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_teq(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_teq: before r" << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm);
 
   reg_value_t result = r[rn] ^ imm;
-  mi = (result >> 31) & 1;
-  z = !result;
+  update_nz(s, result);
 
   DEBUG_LOG("arm_teq: result=" << result << " (flags: N=" << mi << ", Z=" << z
                                << ")");
 }
 
-inline void ExecutionState::arm_cmn(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_value_t imm) {
+template <typename State>
+inline void Cpu<State>::arm_cmn(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_value_t imm) {
   DEBUG_LOG("arm_cmn: before r" << static_cast<int>(rn) << "=" << r[rn]
                                 << ", imm=" << imm);
   reg_value_t result;
-  cs = __builtin_add_overflow(r[rn], imm, &result);
-  int32_t unused;
-  vs = __builtin_sadd_overflow(r[rn], imm, &unused);
-  mi = (result >> 31) & 1;
-  z = !result;
+  bool carry = __builtin_add_overflow(r[rn], imm, &result);
+
+  if (s & FLAG_C)
+    cs = carry;
+  if (s & FLAG_V) {
+    int32_t unused;
+    vs = __builtin_sadd_overflow(r[rn], imm, &unused);
+  }
+  update_nz(s, result);
 
   DEBUG_LOG("arm_cmn: result=" << result << " (flags: N=" << mi << ", Z=" << z
                                << ", C=" << cs << ", V=" << vs << ")");
 }
 
-inline void ExecutionState::arm_mul(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_idx_t rs, reg_idx_t rm) {
+template <typename State>
+inline void Cpu<State>::arm_mul(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_idx_t rs, reg_idx_t rm) {
   DEBUG_LOG("arm_mul: before r" << static_cast<int>(rd) << "=" << r[rd] << ", r"
                                 << static_cast<int>(rm) << "=" << r[rm] << ", r"
                                 << static_cast<int>(rs) << "=" << r[rs]);
   r[rd] = r[rm] * r[rs];
 
-  if (s) {
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  }
+  update_nz(s, r[rd]);
 
   DEBUG_LOG("arm_mul: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_mla(bool s, reg_idx_t rd, reg_idx_t rn,
-                                    reg_idx_t rs, reg_idx_t rm) {
+template <typename State>
+inline void Cpu<State>::arm_mla(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                                reg_idx_t rs, reg_idx_t rm) {
   DEBUG_LOG("arm_mla: before r" << static_cast<int>(rd) << "=" << r[rd] << ", r"
                                 << static_cast<int>(rm) << "=" << r[rm] << ", r"
                                 << static_cast<int>(rs) << "=" << r[rs] << ", r"
                                 << static_cast<int>(rn) << "=" << r[rn]);
   r[rd] = r[rm] * r[rs] + r[rn];
 
-  if (s) {
-    mi = (r[rd] >> 31) & 1;
-    z = !r[rd];
-  }
+  update_nz(s, r[rd]);
 
   DEBUG_LOG("arm_mla: after r" << static_cast<int>(rd) << "=" << r[rd]);
 }
 
-inline void ExecutionState::arm_mull(bool s, bool sign, reg_idx_t rd_lo,
-                                     reg_idx_t rd_hi, reg_idx_t rm,
-                                     reg_idx_t rs) {
+template <typename State>
+inline void Cpu<State>::arm_mull(uint8_t s, bool sign, reg_idx_t rd_lo,
+                                 reg_idx_t rd_hi, reg_idx_t rm,
+                                 reg_idx_t rs) {
   DEBUG_LOG("arm_mull: before r" << static_cast<int>(rd_lo) << "=" << r[rd_lo]
                                  << ", r" << static_cast<int>(rd_hi) << "="
                                  << r[rd_hi] << ", r" << static_cast<int>(rm)
@@ -359,15 +370,16 @@ inline void ExecutionState::arm_mull(bool s, bool sign, reg_idx_t rd_lo,
                                 << static_cast<int>(rd_hi) << "=" << r[rd_hi]
                                 << ")");
 
-  if (s) {
+  if (s & FLAG_N)
     mi = (result >> 63) & 1;
+  if (s & FLAG_Z)
     z = (result == 0);
-  }
 }
 
-inline void ExecutionState::arm_mlal(bool s, bool sign, reg_idx_t rd_lo,
-                                     reg_idx_t rd_hi, reg_idx_t rm,
-                                     reg_idx_t rs) {
+template <typename State>
+inline void Cpu<State>::arm_mlal(uint8_t s, bool sign, reg_idx_t rd_lo,
+                                 reg_idx_t rd_hi, reg_idx_t rm,
+                                 reg_idx_t rs) {
   DEBUG_LOG("arm_mlal: before r" << static_cast<int>(rd_lo) << "=" << r[rd_lo]
                                  << ", r" << static_cast<int>(rd_hi) << "="
                                  << r[rd_hi] << ", r" << static_cast<int>(rm)
@@ -393,15 +405,16 @@ inline void ExecutionState::arm_mlal(bool s, bool sign, reg_idx_t rd_lo,
             << acc << " (r" << static_cast<int>(rd_lo) << "=" << r[rd_lo]
             << ", r" << static_cast<int>(rd_hi) << "=" << r[rd_hi] << ")");
 
-  if (s) {
+  if (s & FLAG_N)
     mi = (acc >> 63) & 1;
+  if (s & FLAG_Z)
     z = (acc == 0);
-  }
 }
 
-inline void ExecutionState::arm_ldr(bool pre_indx, bool add, bool byte,
-                                    bool write_back, reg_idx_t rn, reg_idx_t rd,
-                                    reg_value_t offset, bool copy) {
+template <typename State>
+inline void Cpu<State>::arm_ldr(bool pre_indx, bool add, bool byte,
+                                bool write_back, reg_idx_t rn, reg_idx_t rd,
+                                reg_value_t offset, bool copy) {
   reg_value_t base = r[rn];
   reg_value_t addr = pre_indx ? base + (add ? offset : -offset) : base;
 
@@ -413,11 +426,9 @@ inline void ExecutionState::arm_ldr(bool pre_indx, bool add, bool byte,
                          << std::dec);
 
   if (copy) {
-    const void *mem = reinterpret_cast<const void *>(address_resolve(addr));
+    const void *mem = reinterpret_cast<const void *>(resolve(addr));
 
-    if (UNLIKELY(!mem)) {
-      throw std::runtime_error("arm_ldr: access 0x00000000");
-    }
+    ACCESS_CHECK(mem, "arm_ldr: access 0x00000000");
 
     if (byte) {
       memset(&r[rd], 0, sizeof(reg_value_t));
@@ -442,9 +453,10 @@ inline void ExecutionState::arm_ldr(bool pre_indx, bool add, bool byte,
   }
 }
 
-inline void ExecutionState::arm_str(bool pre_indx, bool add, bool byte,
-                                    bool write_back, reg_idx_t rn, reg_idx_t rd,
-                                    reg_value_t offset, bool copy) {
+template <typename State>
+inline void Cpu<State>::arm_str(bool pre_indx, bool add, bool byte,
+                                bool write_back, reg_idx_t rn, reg_idx_t rd,
+                                reg_value_t offset, bool copy) {
   reg_value_t base = r[rn];
   reg_value_t value = r[rd];
   reg_value_t addr = pre_indx ? base + (add ? offset : -offset) : base;
@@ -463,11 +475,9 @@ inline void ExecutionState::arm_str(bool pre_indx, bool add, bool byte,
                          << std::dec);
 
   if (copy) {
-    void *mem = reinterpret_cast<void *>(address_resolve(addr));
+    void *mem = reinterpret_cast<void *>(resolve(addr));
 
-    if (UNLIKELY(!mem)) {
-      throw std::runtime_error("arm_str: access 0x00000000");
-    }
+    ACCESS_CHECK(mem, "arm_str: access 0x00000000");
 
     if (byte) {
       memcpy(mem, &value, sizeof(uint8_t));
@@ -494,9 +504,10 @@ inline void ExecutionState::arm_str(bool pre_indx, bool add, bool byte,
   }
 }
 
-inline void ExecutionState::arm_ldrh(bool pre_indx, bool add, bool write_back,
-                                     reg_idx_t rn, reg_idx_t rd, uint8_t type,
-                                     uint32_t offset) {
+template <typename State>
+inline void Cpu<State>::arm_ldrh(bool pre_indx, bool add, bool write_back,
+                                 reg_idx_t rn, reg_idx_t rd, uint8_t type,
+                                 uint32_t offset) {
   reg_value_t base = r[rn];
   reg_value_t addr = pre_indx ? base + (add ? offset : -offset) : base;
 
@@ -505,15 +516,13 @@ inline void ExecutionState::arm_ldrh(bool pre_indx, bool add, bool write_back,
                           << ", type=0x" << static_cast<int>(type)
                           << ", addr=0x" << std::hex << addr << std::dec);
 
-  const char *mem = reinterpret_cast<const char *>(address_resolve(addr));
+  const char *mem = reinterpret_cast<const char *>(resolve(addr));
 
-  if (UNLIKELY(!mem)) {
-    throw std::runtime_error("arm_ldrh: access 0x00000000");
-  }
+  ACCESS_CHECK(mem, "arm_ldrh: access 0x00000000");
 
   switch (type) {
   case 0b00:
-    throw std::runtime_error("arm_ldrh: SWP unimplemented!");
+    liblayer_fault("arm_ldrh: SWP unimplemented!");
 
   case 0b01: // LDRHR
     r[rd] = 0;
@@ -558,9 +567,10 @@ inline void ExecutionState::arm_ldrh(bool pre_indx, bool add, bool write_back,
   }
 }
 
-inline void ExecutionState::arm_strh(bool pre_indx, bool add, bool write_back,
-                                     reg_idx_t rn, reg_idx_t rd, uint8_t type,
-                                     uint32_t offset) {
+template <typename State>
+inline void Cpu<State>::arm_strh(bool pre_indx, bool add, bool write_back,
+                                 reg_idx_t rn, reg_idx_t rd, uint8_t type,
+                                 uint32_t offset) {
   reg_value_t base = r[rn];
   reg_value_t value = r[rd];
   reg_value_t addr = pre_indx ? base + (add ? offset : -offset) : base;
@@ -576,15 +586,13 @@ inline void ExecutionState::arm_strh(bool pre_indx, bool add, bool write_back,
                           << ", type=0x" << static_cast<int>(type)
                           << ", addr=0x" << std::hex << addr << std::dec);
 
-  char *mem = reinterpret_cast<char *>(address_resolve(addr));
+  char *mem = reinterpret_cast<char *>(resolve(addr));
 
-  if (UNLIKELY(!mem)) {
-    throw std::runtime_error("arm_stmh: access 0x00000000");
-  }
+  ACCESS_CHECK(mem, "arm_stmh: access 0x00000000");
 
   switch (type) {
   case 0b00:
-    throw std::runtime_error("arm_stmh: SWP unimplemented!");
+    liblayer_fault("arm_stmh: SWP unimplemented!");
 
   case 0b01: // STRHR
     memcpy(mem, &value, sizeof(uint16_t));
@@ -621,9 +629,10 @@ inline void ExecutionState::arm_strh(bool pre_indx, bool add, bool write_back,
   }
 }
 
-inline void ExecutionState::arm_ldm(bool pre_indx, bool add, bool write_back,
-                                    reg_idx_t rn, reg_value_t reg_list,
-                                    bool copy) {
+template <typename State>
+inline void Cpu<State>::arm_ldm(bool pre_indx, bool add, bool write_back,
+                                reg_idx_t rn, reg_value_t reg_list,
+                                bool copy) {
   reg_value_t base = r[rn];
   reg_value_t n = __builtin_popcount(reg_list);
   reg_value_t addr;
@@ -631,7 +640,7 @@ inline void ExecutionState::arm_ldm(bool pre_indx, bool add, bool write_back,
   if (add) {
     addr = pre_indx ? base + 4 : base;
   } else {
-    addr = pre_indx ? base - (n * 4) : base - 4;
+    addr = pre_indx ? base - n * 4 : base - n * 4 + 4;
   }
 
   DEBUG_LOG("arm_ldm: r" << static_cast<int>(rn) << ", reg_list=0x" << std::hex
@@ -647,11 +656,9 @@ inline void ExecutionState::arm_ldm(bool pre_indx, bool add, bool write_back,
   }
 
   if (copy) {
-    const char *mem = reinterpret_cast<const char *>(address_resolve(addr));
+    const char *mem = reinterpret_cast<const char *>(resolve(addr));
 
-    if (UNLIKELY(!mem)) {
-      throw std::runtime_error("arm_ldm: access 0x00000000");
-    }
+    ACCESS_CHECK(mem, "arm_ldm: access 0x00000000");
 
     for (reg_value_t i = 0; i < REG_COUNT; i++) {
       if (!((reg_list >> i) & 1)) {
@@ -668,9 +675,10 @@ inline void ExecutionState::arm_ldm(bool pre_indx, bool add, bool write_back,
   }
 }
 
-inline void ExecutionState::arm_stm(bool pre_indx, bool add, bool write_back,
-                                    reg_idx_t rn, reg_value_t reg_list,
-                                    bool copy) {
+template <typename State>
+inline void Cpu<State>::arm_stm(bool pre_indx, bool add, bool write_back,
+                                reg_idx_t rn, reg_value_t reg_list,
+                                bool copy) {
   reg_value_t base = r[rn];
   reg_value_t n = __builtin_popcount(reg_list);
   reg_value_t addr;
@@ -678,7 +686,7 @@ inline void ExecutionState::arm_stm(bool pre_indx, bool add, bool write_back,
   if (add) {
     addr = pre_indx ? base + 4 : base;
   } else {
-    addr = pre_indx ? base - n * 4 : base - 4;
+    addr = pre_indx ? base - n * 4 : base - n * 4 + 4;
   }
 
   DEBUG_LOG("arm_stm: r" << static_cast<int>(rn) << ", reg_list=0x" << std::hex
@@ -688,12 +696,10 @@ inline void ExecutionState::arm_stm(bool pre_indx, bool add, bool write_back,
                          << std::dec);
 
   if (copy) {
-    char *mem = reinterpret_cast<char *>(address_resolve(addr));
+    char *mem = reinterpret_cast<char *>(resolve(addr));
     bool written = false;
 
-    if (UNLIKELY(!mem)) {
-      throw std::runtime_error("arm_stm: access 0x00000000");
-    }
+    ACCESS_CHECK(mem, "arm_stm: access 0x00000000");
 
     for (reg_value_t i = 0; i < REG_COUNT; i++) {
       if (!((reg_list >> i) & 1)) {
@@ -720,3 +726,84 @@ inline void ExecutionState::arm_stm(bool pre_indx, bool add, bool write_back,
     }
   }
 }
+
+// Returns the first register after the run of consecutive registers in the
+// list that starts at `first`.
+constexpr inline reg_idx_t reg_run_end(reg_value_t reg_list, reg_idx_t first) {
+  while (first < REG_COUNT && ((reg_list >> first) & 1)) {
+    first++;
+  }
+
+  return first;
+}
+
+// Copies listed registers from FIRST on between r[] and guest memory. The
+// recursion unrolls at compile time, every run of consecutive registers is
+// copied with a single memcpy.
+template <typename State>
+template <bool LOAD, reg_value_t LIST, reg_idx_t FIRST>
+ALWAYS_INLINE void Cpu<State>::block_copy(char *mem) {
+  if constexpr (FIRST < REG_COUNT) {
+    if constexpr (!((LIST >> FIRST) & 1)) {
+      block_copy<LOAD, LIST, FIRST + 1>(mem);
+    } else {
+      constexpr reg_idx_t last = reg_run_end(LIST, FIRST);
+      constexpr size_t size = (last - FIRST) * sizeof(uint32_t);
+
+      if constexpr (LOAD) {
+        memcpy(&r[FIRST], mem, size);
+      } else {
+        memcpy(mem, &r[FIRST], size);
+      }
+
+      block_copy<LOAD, LIST, last>(mem + size);
+    }
+  }
+}
+
+template <typename State>
+template <bool PRE, bool ADD, bool WB, reg_idx_t RN, reg_value_t LIST>
+inline void Cpu<State>::arm_ldm() {
+  constexpr reg_value_t n = __builtin_popcount(LIST);
+  const reg_value_t base = r[RN];
+  const reg_value_t addr =
+      ADD ? (PRE ? base + 4 : base) : (PRE ? base - n * 4 : base - n * 4 + 4);
+
+  DEBUG_LOG("arm_ldm: r" << static_cast<int>(RN) << ", reg_list=0x" << std::hex
+                         << LIST << ", base=0x" << base << ", starting addr=0x"
+                         << addr << std::dec);
+
+  if constexpr (WB) {
+    r[RN] = ADD ? base + n * 4 : base - n * 4;
+  }
+
+  char *mem = reinterpret_cast<char *>(resolve(addr));
+
+  ACCESS_CHECK(mem, "arm_ldm: access 0x00000000");
+
+  block_copy<true, LIST>(mem);
+}
+
+template <typename State>
+template <bool PRE, bool ADD, bool WB, reg_idx_t RN, reg_value_t LIST>
+inline void Cpu<State>::arm_stm() {
+  constexpr reg_value_t n = __builtin_popcount(LIST);
+  const reg_value_t base = r[RN];
+  const reg_value_t addr =
+      ADD ? (PRE ? base + 4 : base) : (PRE ? base - n * 4 : base - n * 4 + 4);
+
+  DEBUG_LOG("arm_stm: r" << static_cast<int>(RN) << ", reg_list=0x" << std::hex
+                         << LIST << ", base=0x" << base << ", starting addr=0x"
+                         << addr << std::dec);
+
+  char *mem = reinterpret_cast<char *>(resolve(addr));
+
+  ACCESS_CHECK(mem, "arm_stm: access 0x00000000");
+
+  // Rn in the list is stored before write-back, as if it was the first one
+  block_copy<false, LIST>(mem);
+
+  if constexpr (WB) {
+    r[RN] = ADD ? base + n * 4 : base - n * 4;
+  }
+}
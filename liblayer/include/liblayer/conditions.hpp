@@ -1,80 +1,99 @@
 
+/* Condition checks. Runs of instructions with the same condition share one
+ * `if COND_XX { ... }` block, single instructions use the XX(x) form. */
+#define COND_EQ (ps.z)
+#define COND_NE (!ps.z)
+#define COND_CS (ps.cs)
+#define COND_CC (!ps.cs)
+#define COND_MI (ps.mi)
+#define COND_PL (!ps.mi)
+#define COND_VS (ps.vs)
+#define COND_VC (!ps.vs)
+#define COND_HI (ps.cs && !ps.z)
+#define COND_LS (!ps.cs || ps.z)
+#define COND_GE (ps.mi == ps.vs)
+#define COND_LT (ps.mi != ps.vs)
+#define COND_GT (!ps.z && (ps.mi == ps.vs))
+#define COND_LE (ps.z || (ps.mi != ps.vs))
+#define COND_AL (1)
+#define COND_NV (0)
+
 #define EQ(x)                                                                  \
-  if (ps.z) {                                                                  \
+  if COND_EQ {                                                                 \
     x;                                                                         \
   }
 
 #define NE(x)                                                                  \
-  if (!ps.z) {                                                                 \
+  if COND_NE {                                                                 \
     x;                                                                         \
   }
 
 #define CS(x)                                                                  \
-  if (ps.cs) {                                                                 \
+  if COND_CS {                                                                 \
     x;                                                                         \
   }
 
 #define CC(x)                                                                  \
-  if (!ps.cs) {                                                                \
+  if COND_CC {                                                                 \
     x;                                                                         \
   }
 
 #define MI(x)                                                                  \
-  if (ps.mi) {                                                                 \
+  if COND_MI {                                                                 \
     x;                                                                         \
   }
 
 #define PL(x)                                                                  \
-  if (!ps.mi) {                                                                \
+  if COND_PL {                                                                 \
     x;                                                                         \
   }
 
 #define VS(x)                                                                  \
-  if (ps.vs) {                                                                 \
+  if COND_VS {                                                                 \
     x;                                                                         \
   }
 
 #define VC(x)                                                                  \
-  if (!ps.vs) {                                                                \
+  if COND_VC {                                                                 \
     x;                                                                         \
   }
 
 #define HI(x)                                                                  \
-  if (ps.cs && !ps.z) {                                                        \
+  if COND_HI {                                                                 \
     x;                                                                         \
   }
 
 #define LS(x)                                                                  \
-  if (!ps.cs || ps.z) {                                                        \
+  if COND_LS {                                                                 \
     x;                                                                         \
   }
 
 #define GE(x)                                                                  \
-  if (ps.mi == ps.vs) {                                                        \
+  if COND_GE {                                                                 \
     x;                                                                         \
   }
 
 #define LT(x)                                                                  \
-  if (ps.mi != ps.vs) {                                                        \
+  if COND_LT {                                                                 \
     x;                                                                         \
   }
 
 #define GT(x)                                                                  \
-  if (!ps.z && (ps.mi == ps.vs)) {                                             \
+  if COND_GT {                                                                 \
     x;                                                                         \
   }
 
 #define LE(x)                                                                  \
-  if (ps.z || (ps.mi != ps.vs)) {                                              \
+  if COND_LE {                                                                 \
     x;                                                                         \
   }
 
 #define AL(x)                                                                  \
-  if (1) {                                                                     \
+  if COND_AL {                                                                 \
     x;                                                                         \
   }
 
 #define NV(x)                                                                  \
-  if (0) {                                                                     \
+  if COND_NV {                                                                 \
     x;                                                                         \
   }
@@ -1,7 +1,11 @@
 #pragma once
 #include <cstdint>
 #include <cstring>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
 
 #ifndef LIBLAYER_STACK_BASE
 #define LIBLAYER_STACK_BASE (0xC0000000) // Virtual address of stack pointer
@@ -19,6 +23,17 @@
 #define LIBLAYER_MEMORY_SIZE (1024 * 1024 * 16) // Size of the memory (16 MB)
 #endif
 
+// With LIBLAYER_FASTMEM the whole 4 GB guest address space is reserved at
+// once and stack, memory and ELF sections are mapped at their guest addresses,
+// so translation is `fastmem + addr`. Everything else in the reservation is
+// PROT_NONE and acts as guard pages: instead of checking each translation,
+// loads and stores outside mapped memory (stack overflows, wild pointers)
+// raise SIGSEGV, which is reported with the guest address. Needs a 64-bit
+// POSIX host.
+#ifdef LIBLAYER_FASTMEM
+#define LIBLAYER_FASTMEM_SIZE (0x100000000ull) // Size of the reservation (4 GB)
+#endif
+
 #ifdef LIBLAYER_DEBUG
 #include <iostream>
 #define DEBUG_LOG(fmt, ...)                                                    \
@@ -31,6 +46,50 @@
   } while (0)
 #endif
 
+// Helpers are always inlined into their specialized forms (see Cpu), so that
+// operands known at compile time fold away no matter how big the caller is.
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// Error paths are kept out of line and cold, so the compiler moves them to
+// .text.unlikely instead of laying them out between hot code.
+#ifdef __GNUC__
+#define COLD __attribute__((cold, noinline))
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define COLD
+#define UNLIKELY(x) (x)
+#endif
+
+// Throws on a guest error that can't be recovered from (illegal instruction,
+// invalid address, ...), used by both liblayer and generated code.
+[[noreturn]] COLD inline void liblayer_fault(const char *message) {
+  throw std::runtime_error(message);
+}
+
+[[noreturn]] COLD inline void liblayer_fault(const char *message,
+                                             uint32_t address) {
+  throw std::runtime_error(message + std::to_string(address));
+}
+
+// Faults on a failed translation of a guest address. Not needed with fastmem,
+// where translation can't fail and the guard pages catch bad accesses.
+#ifdef LIBLAYER_FASTMEM
+#define ACCESS_CHECK(mem, message)                                             \
+  do {                                                                         \
+  } while (0)
+#else
+#define ACCESS_CHECK(mem, message)                                             \
+  do {                                                                         \
+    if (UNLIKELY(!(mem))) {                                                    \
+      liblayer_fault(message);                                                 \
+    }                                                                          \
+  } while (0)
+#endif
+
 typedef uint8_t reg_idx_t;
 typedef uint32_t reg_value_t;
 
@@ -55,94 +114,494 @@ enum {
   REG_COUNT = 16,
 };
 
-class ExecutionState {
+// FLAGS (which flags should an instruction update)
+enum {
+  FLAG_N = 1 << 0,
+  FLAG_Z = 1 << 1,
+  FLAG_C = 1 << 2,
+  FLAG_V = 1 << 3,
+  FLAGS_ALL = FLAG_N | FLAG_Z | FLAG_C | FLAG_V,
+};
+
+// Guest registers and armv4 instructions operating on them. Memory accesses
+// are translated trough State::address_resolve, so the same instructions work
+// on ExecutionState itself as well as on a LocalState copy of its registers.
+template <typename State> class Cpu {
+public:
+  reg_value_t r[REG_COUNT] = {0};
+
+  bool cs = false, /* carry set */
+      vs = false;  /* overflow set */
+  bool mi = false, /* negative */
+      z = false;   /* zero */
+
+  // armv4 (`s` is a mask of FLAG_* to update)
+
+  ALWAYS_INLINE void arm_add(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_adc(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_sub(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_sbc(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_cmp(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_mov(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_rsb(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_rsc(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_and(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_eor(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_orr(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_bic(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_mvn(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_tst(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_teq(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+  ALWAYS_INLINE void arm_cmn(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                              reg_value_t imm);
+
+  ALWAYS_INLINE void arm_mul(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                             reg_idx_t rs, reg_idx_t rm);
+  ALWAYS_INLINE void arm_mla(uint8_t s, reg_idx_t rd, reg_idx_t rn,
+                             reg_idx_t rs, reg_idx_t rm);
+
+  ALWAYS_INLINE void arm_mull(uint8_t s, bool sign, reg_idx_t rd_hi,
+                              reg_idx_t rd_lo, reg_idx_t rs, reg_idx_t rm);
+  ALWAYS_INLINE void arm_mlal(uint8_t s, bool sign, reg_idx_t rd_hi,
+                              reg_idx_t rd_lo, reg_idx_t rs, reg_idx_t rm);
+
+  ALWAYS_INLINE void arm_ldr(bool pre_indx, bool add, bool byte,
+                             bool write_back, reg_idx_t rn, reg_idx_t rd,
+                             reg_value_t offset, bool copy);
+  ALWAYS_INLINE void arm_str(bool pre_indx, bool add, bool byte,
+                             bool write_back, reg_idx_t rn, reg_idx_t rd,
+                             reg_value_t offset, bool copy);
+  ALWAYS_INLINE void arm_ldm(bool pre_indx, bool add, bool write_back,
+                             reg_idx_t rn, reg_value_t reg_list, bool copy);
+  ALWAYS_INLINE void arm_stm(bool pre_indx, bool add, bool write_back,
+                             reg_idx_t rn, reg_value_t reg_list, bool copy);
+  ALWAYS_INLINE void arm_ldrh(bool pre_indx, bool add, bool write_back,
+                              reg_idx_t rn, reg_idx_t rd, uint8_t type,
+                              uint32_t offset);
+  ALWAYS_INLINE void arm_strh(bool pre_indx, bool add, bool write_back,
+                              reg_idx_t rn, reg_idx_t rd, uint8_t type,
+                              uint32_t offset);
+
+  // armv4, specialized. Operands that the recompiler knows are template
+  // parameters, every instantiation is then compiled with them folded in.
+
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_add(reg_value_t imm) {
+    arm_add(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_adc(reg_value_t imm) {
+    arm_adc(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_sub(reg_value_t imm) {
+    arm_sub(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_sbc(reg_value_t imm) {
+    arm_sbc(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_cmp(reg_value_t imm) {
+    arm_cmp(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_mov(reg_value_t imm) {
+    arm_mov(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_rsb(reg_value_t imm) {
+    arm_rsb(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_rsc(reg_value_t imm) {
+    arm_rsc(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_and(reg_value_t imm) {
+    arm_and(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_eor(reg_value_t imm) {
+    arm_eor(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_orr(reg_value_t imm) {
+    arm_orr(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_bic(reg_value_t imm) {
+    arm_bic(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_mvn(reg_value_t imm) {
+    arm_mvn(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_tst(reg_value_t imm) {
+    arm_tst(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_teq(reg_value_t imm) {
+    arm_teq(S, RD, RN, imm);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN>
+  inline void arm_cmn(reg_value_t imm) {
+    arm_cmn(S, RD, RN, imm);
+  }
+
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN, reg_idx_t RS, reg_idx_t RM>
+  inline void arm_mul() {
+    arm_mul(S, RD, RN, RS, RM);
+  }
+  template <uint8_t S, reg_idx_t RD, reg_idx_t RN, reg_idx_t RS, reg_idx_t RM>
+  inline void arm_mla() {
+    arm_mla(S, RD, RN, RS, RM);
+  }
+
+  template <uint8_t S, bool SIGN, reg_idx_t RD_LO, reg_idx_t RD_HI,
+            reg_idx_t RM, reg_idx_t RS>
+  inline void arm_mull() {
+    arm_mull(S, SIGN, RD_LO, RD_HI, RM, RS);
+  }
+  template <uint8_t S, bool SIGN, reg_idx_t RD_LO, reg_idx_t RD_HI,
+            reg_idx_t RM, reg_idx_t RS>
+  inline void arm_mlal() {
+    arm_mlal(S, SIGN, RD_LO, RD_HI, RM, RS);
+  }
+
+  template <bool PRE, bool ADD, bool BYTE, bool WB, reg_idx_t RN, reg_idx_t RD>
+  inline void arm_ldr(reg_value_t offset) {
+    arm_ldr(PRE, ADD, BYTE, WB, RN, RD, offset, true);
+  }
+  template <bool PRE, bool ADD, bool BYTE, bool WB, reg_idx_t RN, reg_idx_t RD>
+  inline void arm_str(reg_value_t offset) {
+    arm_str(PRE, ADD, BYTE, WB, RN, RD, offset, true);
+  }
+  template <bool PRE, bool ADD, bool WB, reg_idx_t RN, reg_value_t LIST>
+  inline void arm_ldm();
+  template <bool PRE, bool ADD, bool WB, reg_idx_t RN, reg_value_t LIST>
+  inline void arm_stm();
+  template <bool PRE, bool ADD, bool WB, reg_idx_t RN, reg_idx_t RD,
+            uint8_t TYPE>
+  inline void arm_ldrh(uint32_t offset) {
+    arm_ldrh(PRE, ADD, WB, RN, RD, TYPE, offset);
+  }
+  template <bool PRE, bool ADD, bool WB, reg_idx_t RN, reg_idx_t RD,
+            uint8_t TYPE>
+  inline void arm_strh(uint32_t offset) {
+    arm_strh(PRE, ADD, WB, RN, RD, TYPE, offset);
+  }
+
+  // Plain word accesses, used for spill slots that recompiled functions keep
+  // in locals.
+
+  inline uint32_t mem_read32(uint32_t addr) {
+    const void *mem = reinterpret_cast<const void *>(resolve(addr));
+    ACCESS_CHECK(mem, "mem_read32: access 0x00000000");
+
+    uint32_t value;
+    memcpy(&value, mem, sizeof(uint32_t));
+    return value;
+  }
+
+  inline void mem_write32(uint32_t addr, uint32_t value) {
+    void *mem = reinterpret_cast<void *>(resolve(addr));
+    ACCESS_CHECK(mem, "mem_write32: access 0x00000000");
+
+    memcpy(mem, &value, sizeof(uint32_t));
+  }
+
+  /* THUMB instructions */
+  // TODO: add thumb
+
 private:
-  std::mutex memory_mutex;
+  inline void update_nz(uint8_t s, reg_value_t result) {
+    if (s & FLAG_N)
+      mi = (result >> 31) & 1;
+    if (s & FLAG_Z)
+      z = !result;
+  }
+
+  template <bool LOAD, reg_value_t LIST, reg_idx_t FIRST = 0>
+  ALWAYS_INLINE void block_copy(char *mem);
 
+  inline uintptr_t resolve(uint32_t addr) {
+#ifdef LIBLAYER_FASTMEM
+    return reinterpret_cast<uintptr_t>(static_cast<State *>(this)->fastmem) +
+           addr;
+#else
+    return static_cast<State *>(this)->address_resolve(addr);
+#endif
+  }
+};
+
+// Two-level table of 4 KB guest pages, which translates addresses in both
+// directions in constant time. Only pages that lie entirely inside a mapping
+// are entered, the rest (e.g. a page shared by two sections) is left for the
+// caller to check.
+class PageTable {
 public:
-  reg_value_t r[REG_COUNT] = {
-      0, 0,
-      0, 0,
-      0, 0,
-      0, 0,
-      0, 0,
-      0, 0,
-      0, LIBLAYER_STACK_BASE + LIBLAYER_STACK_SIZE - 1, // stack ptr
-      0, 0,
-  };
-
-  bool cs, /* carry set */
-      vs;  /* overflow set */
-  bool mi, /* negative */
-      z;   /* zero */
+  static constexpr uint64_t PAGE_BYTES = 1 << 12;
+  static constexpr uint32_t DIR_ENTRIES = 1 << 10;
+
+  // Maps guest memory at [addr, addr + size) to host memory at `host`.
+  inline void map(uint32_t addr, uint32_t size, const void *host) {
+    const uintptr_t start = reinterpret_cast<uintptr_t>(host);
+    const uint64_t end = static_cast<uint64_t>(addr) + size;
+
+    // entries hold the difference between host and guest address, 0 if
+    // the page isn't mapped
+    for (uint64_t page = (addr + PAGE_BYTES - 1) & ~(PAGE_BYTES - 1);
+         page + PAGE_BYTES <= end; page += PAGE_BYTES) {
+      auto &dir = dirs[page / PAGE_BYTES / DIR_ENTRIES];
+      if (!dir) {
+        dir = std::make_unique<uintptr_t[]>(DIR_ENTRIES);
+      }
+
+      dir[(page / PAGE_BYTES) % DIR_ENTRIES] = start - addr;
+    }
+
+    for (uintptr_t page = (start + PAGE_BYTES - 1) & ~(PAGE_BYTES - 1);
+         page + PAGE_BYTES <= start + size; page += PAGE_BYTES) {
+      host_pages[page / PAGE_BYTES] = addr - start;
+    }
+  }
+
+  // Returns host address of guest `addr`, or 0 if its page isn't mapped.
+  inline uintptr_t resolve(uint32_t addr) const {
+    const uintptr_t *dir = dirs[addr / PAGE_BYTES / DIR_ENTRIES].get();
+    if (!dir) {
+      return 0;
+    }
+
+    const uintptr_t delta = dir[(addr / PAGE_BYTES) % DIR_ENTRIES];
+    return delta ? addr + delta : 0;
+  }
+
+  // Returns guest address of host `addr`, or 0 if its page isn't mapped.
+  inline uint32_t lookup(uintptr_t addr) const {
+    auto it = host_pages.find(addr / PAGE_BYTES);
+    return it != host_pages.end() ? static_cast<uint32_t>(addr + it->second)
+                                  : 0;
+  }
+
+private:
+  std::unique_ptr<uintptr_t[]> dirs[(1ull << 32) / PAGE_BYTES / DIR_ENTRIES];
+  std::unordered_map<uintptr_t, uintptr_t> host_pages;
+};
+
+// Guest stack and memory, with the translation of their addresses.
+class Memory {
+private:
+  std::mutex memory_mutex;
 
+public:
+#ifdef LIBLAYER_FASTMEM
+  uint8_t *fastmem = nullptr; /* guest address space */
+  uint8_t *stack = nullptr;   /* stack, inside fastmem */
+#else
   uint8_t stack[LIBLAYER_STACK_SIZE] = {0}; /* stack */
-  uint8_t *memory = nullptr;                /* memory */
+#endif
+  uint8_t *memory = nullptr; /* memory */
+#ifndef LIBLAYER_FASTMEM
+  PageTable pages; /* guest pages, filled by the state and its subclasses */
+#endif
 
-  inline ExecutionState() {
+  inline Memory() {
+#ifdef LIBLAYER_FASTMEM
+    fastmem_init();
+    stack = fastmem_map(LIBLAYER_STACK_BASE, LIBLAYER_STACK_SIZE);
+    memory = fastmem_map(LIBLAYER_MEMORY_BASE, LIBLAYER_MEMORY_SIZE);
+#else
     memory = new uint8_t[LIBLAYER_MEMORY_SIZE];
+    pages.map(LIBLAYER_STACK_BASE, LIBLAYER_STACK_SIZE, stack);
+    pages.map(LIBLAYER_MEMORY_BASE, LIBLAYER_MEMORY_SIZE, memory);
+#endif
     memory_init();
   }
 
-  inline ~ExecutionState() { delete[] memory; }
+#ifdef LIBLAYER_FASTMEM
+  inline ~Memory() { fastmem_free(); }
+#else
+  inline ~Memory() { delete[] memory; }
+#endif
+
+  // Translation of stack and memory addresses (or the whole address space
+  // with fastmem), 0 if the address is elsewhere.
+
+  inline uint32_t memory_map(uintptr_t addr) const {
+#ifdef LIBLAYER_FASTMEM
+    if (addr >= reinterpret_cast<uintptr_t>(fastmem) &&
+        addr < reinterpret_cast<uintptr_t>(fastmem) + LIBLAYER_FASTMEM_SIZE) {
+      return static_cast<uint32_t>(addr -
+                                   reinterpret_cast<uintptr_t>(fastmem));
+    }
+
+    return 0;
+#else
+    if (uint32_t mapped = pages.lookup(addr)) {
+      return mapped;
+    }
+
+    if (addr >= reinterpret_cast<uintptr_t>(stack) &&
+        addr < reinterpret_cast<uintptr_t>(stack) + LIBLAYER_STACK_SIZE) {
+      return LIBLAYER_STACK_BASE +
+             static_cast<uint32_t>(addr - reinterpret_cast<uintptr_t>(stack));
+    } else if (addr >= reinterpret_cast<uintptr_t>(memory) &&
+               addr < reinterpret_cast<uintptr_t>(memory) +
+                          LIBLAYER_MEMORY_SIZE) {
+      return LIBLAYER_MEMORY_BASE +
+             static_cast<uint32_t>(addr - reinterpret_cast<uintptr_t>(memory));
+    }
 
-  virtual uint32_t address_map(uintptr_t addr);
-  virtual uintptr_t address_resolve(uint32_t addr);
+    return 0;
+#endif
+  }
+
+  inline uintptr_t memory_resolve(uint32_t addr) const {
+#ifdef LIBLAYER_FASTMEM
+    return reinterpret_cast<uintptr_t>(fastmem) + addr;
+#else
+    if (uintptr_t mapped = pages.resolve(addr)) {
+      return mapped;
+    }
 
-  // Allocations
+    if (addr >= LIBLAYER_STACK_BASE &&
+        addr < LIBLAYER_STACK_BASE + LIBLAYER_STACK_SIZE) {
+      return reinterpret_cast<uintptr_t>(&stack[addr - LIBLAYER_STACK_BASE]);
+    } else if (addr >= LIBLAYER_MEMORY_BASE &&
+               addr < LIBLAYER_MEMORY_BASE + LIBLAYER_MEMORY_SIZE) {
+      return reinterpret_cast<uintptr_t>(&memory[addr - LIBLAYER_MEMORY_BASE]);
+    }
+
+    return 0;
+#endif
+  }
+
+#ifdef LIBLAYER_FASTMEM
+  // Guest address space
+
+  void fastmem_init();
+  void fastmem_free();
+
+  // Makes guest memory at [addr, addr + size) accessible and returns its host
+  // address. Pages read as zero until written.
+  uint8_t *fastmem_map(uint32_t addr, uint32_t size);
+#endif
+
+  // Allocations from `memory`, with the semantics of malloc/calloc/realloc/
+  // free. Two-level segregated fit (TLSF): free blocks are kept in lists by
+  // size class, which bitmaps find in constant time, and are merged with free
+  // neighbours on free.
 
   void memory_init();
   void *memory_alloc(uint32_t size);
+  void *memory_calloc(uint32_t count, uint32_t size);
+  void *memory_realloc(void *p, uint32_t size);
   void memory_free(void *p);
 
-  // armv4
-
-  void arm_add(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_adc(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_sub(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_sbc(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_cmp(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_mov(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_rsb(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_rsc(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_and(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_eor(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_orr(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_bic(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_mvn(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_tst(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_teq(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-  void arm_cmn(bool s, reg_idx_t rd, reg_idx_t rn, reg_value_t imm);
-
-  void arm_mul(bool s, reg_idx_t rd, reg_idx_t rn, reg_idx_t rs, reg_idx_t rm);
-  void arm_mla(bool s, reg_idx_t rd, reg_idx_t rn, reg_idx_t rs, reg_idx_t rm);
-
-  void arm_mull(bool s, bool sign, reg_idx_t rd_hi, reg_idx_t rd_lo,
-                reg_idx_t rs, reg_idx_t rm);
-  void arm_mlal(bool s, bool sign, reg_idx_t rd_hi, reg_idx_t rd_lo,
-                reg_idx_t rs, reg_idx_t rm);
-
-  void arm_ldr(bool pre_indx, bool add, bool byte, bool write_back,
-               reg_idx_t rn, reg_idx_t rd, reg_value_t offset, bool copy);
-  void arm_str(bool pre_indx, bool add, bool byte, bool write_back,
-               reg_idx_t rn, reg_idx_t rd, reg_value_t offset, bool copy);
-  void arm_ldm(bool pre_indx, bool add, bool write_back, reg_idx_t rn,
-               reg_value_t reg_list, bool copy);
-  void arm_stm(bool pre_indx, bool add, bool write_back, reg_idx_t rn,
-               reg_value_t reg_list, bool copy);
-  void arm_ldrh(bool pre_indx, bool add, bool write_back, reg_idx_t rn,
-                reg_idx_t rd, uint8_t type, uint32_t offset);
-  void arm_strh(bool pre_indx, bool add, bool write_back, reg_idx_t rn,
-                reg_idx_t rd, uint8_t type, uint32_t offset);
+private:
+  static constexpr uint32_t HEAP_SL_COUNT = 16; // Size classes per power of 2
+  static constexpr uint32_t HEAP_FL_COUNT = 26; // Powers of 2 up to 4 GB
+
+  uint32_t heap_fl_bitmap = 0;                  /* non-empty rows */
+  uint32_t heap_sl_bitmap[HEAP_FL_COUNT] = {0}; /* non-empty lists */
+  uint32_t heap_free[HEAP_FL_COUNT][HEAP_SL_COUNT]; /* first free blocks */
 
-  /* THUMB instructions */
-  // TODO: add thumb
+  static void heap_mapping(uint32_t size, uint32_t &fl, uint32_t &sl);
+  void heap_insert(uint32_t block);
+  void heap_remove(uint32_t block);
+  void heap_release(uint32_t block);
+  void heap_split(uint32_t block, uint32_t size);
+  void *heap_alloc(uint32_t size);
+};
+
+// Guest registers and memory. `State` is the most derived class: instructions
+// call its address_resolve, which is a direct (and inlined) call when the
+// class is `final`, like the generated ProgramState. ExecutionState keeps the
+// virtual interface for states that are extended further (libcharm Emulator).
+template <typename State>
+class BasicExecutionState : public Cpu<State>, public Memory {
+public:
+  inline BasicExecutionState() {
+    // stack ptr
+    this->r[REG_SP] = LIBLAYER_STACK_BASE + LIBLAYER_STACK_SIZE - 1;
+  }
+
+  virtual uint32_t address_map(uintptr_t addr) { return memory_map(addr); }
+
+  virtual uintptr_t address_resolve(uint32_t addr) {
+    return memory_resolve(addr);
+  }
+};
+
+class ExecutionState : public BasicExecutionState<ExecutionState> {};
+
+// A copy of guest registers that lives on the host stack. Recompiled functions
+// work on it instead of the state itself when LIBLAYER_LOCAL_REGS is defined,
+// which lets the compiler keep guest registers in host registers. Memory is
+// still accessed trough the state, registers are written back with store()
+// whenever control leaves the function and reloaded with load().
+template <typename State> class LocalState : public Cpu<LocalState<State>> {
+public:
+  State &state;
+#ifdef LIBLAYER_FASTMEM
+  uint8_t *fastmem; /* same as state's */
+#endif
+
+  inline LocalState(State &state) : state(state) {
+#ifdef LIBLAYER_FASTMEM
+    fastmem = state.fastmem;
+#endif
+    load();
+  }
+
+  inline void load() {
+    memcpy(this->r, state.r, sizeof(this->r));
+    this->cs = state.cs;
+    this->vs = state.vs;
+    this->mi = state.mi;
+    this->z = state.z;
+  }
+
+  inline void store() {
+    memcpy(state.r, this->r, sizeof(this->r));
+    state.cs = this->cs;
+    state.vs = this->vs;
+    state.mi = this->mi;
+    state.z = this->z;
+  }
+
+  inline uintptr_t address_resolve(uint32_t addr) {
+    return state.address_resolve(addr);
+  }
 };
 
 /* Conditions */
 #include "conditions.hpp"
 
+// Instructions are templates and inline functions, so every translation unit
+// of recompiled code can include them. The rest is only compiled once.
+#if defined(LIBLAYER_IMPL) || defined(LIBLAYER_INSTRUCTIONS)
+#include "armv4.cpp" // ARMv4 (ARM instructions)
+#endif
+
 #ifdef LIBLAYER_IMPL
-#include "armv4.cpp"  // ARMv4 (ARM instructions)
 #include "memory.cpp" // addressing / alloc / free
 #endif
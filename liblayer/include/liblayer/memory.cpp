@@ -1,153 +1,440 @@
 #include "liblayer.hpp"
 #include <cstring>
-#include <iostream>
 #include <mutex>
-#include <ostream>
 
-#define BLOCK_SIZE (64)                         // Min allocation
-#define BLOCK_ITER (BLOCK_SIZE + sizeof(Block)) // + sizeof(Block)
+#ifdef LIBLAYER_FASTMEM
+#include <atomic>
+#include <sys/mman.h>
+#include <unistd.h>
 
+// glibc's <sys/ucontext.h> names the host registers REG_R8 etc. with
+// _GNU_SOURCE, which clashes with the guest registers
+#pragma push_macro("__USE_GNU")
+#undef __USE_GNU
+#include <csignal>
+#pragma pop_macro("__USE_GNU")
+#endif
+
+#define BLOCK_HEADER (8) // Header in front of each block
+#define BLOCK_ALIGN (8)  // Alignment of blocks and their sizes
+#define BLOCK_MIN (8)    // Smallest payload, room for the free list links
+#define BLOCK_FREE (1u)  // Flag in Block::size
+#define BLOCK_NONE (0xFFFFFFFFu) // No block
+
+#define HEAP_SL_LOG2 (4) // log2(HEAP_SL_COUNT)
+#define HEAP_FL_SHIFT (7) // log2(HEAP_SMALL)
+#define HEAP_SMALL (1u << HEAP_FL_SHIFT) // Sizes below are in linear classes
+
+// Blocks follow each other in `memory`, addressed by their offset. The last
+// one is a used block of size 0, so every block has a next one.
 struct Block {
-  bool allocated;
-  uint32_t size;
+  uint32_t prev; /* previous block, BLOCK_NONE for the first one */
+  uint32_t size; /* size of the payload | BLOCK_FREE */
+
+  // in the payload, only while free
+  uint32_t next_free;
+  uint32_t prev_free;
 };
 
-inline uint32_t ExecutionState::address_map(uintptr_t addr) {
-  if (addr >= reinterpret_cast<uintptr_t>(stack) &&
-      addr < reinterpret_cast<uintptr_t>(stack) + LIBLAYER_STACK_SIZE) {
-    return LIBLAYER_STACK_BASE +
-           static_cast<uint32_t>(addr - reinterpret_cast<uintptr_t>(stack));
-  } else if (addr >= reinterpret_cast<uintptr_t>(memory) &&
-             addr <
-                 reinterpret_cast<uintptr_t>(memory) + LIBLAYER_MEMORY_SIZE) {
-    return LIBLAYER_MEMORY_BASE +
-           static_cast<uint32_t>(addr - reinterpret_cast<uintptr_t>(memory));
-  }
+static inline Block *block_at(uint8_t *memory, uint32_t block) {
+  return reinterpret_cast<Block *>(memory + block);
+}
+
+static inline uint32_t block_size(const Block *blk) {
+  return blk->size & ~BLOCK_FREE;
+}
 
-  return 0;
+static inline uint32_t block_next(uint32_t block, const Block *blk) {
+  return block + BLOCK_HEADER + block_size(blk);
 }
 
-inline uintptr_t ExecutionState::address_resolve(uint32_t addr) {
-  if (addr >= LIBLAYER_STACK_BASE &&
-      addr < LIBLAYER_STACK_BASE + LIBLAYER_STACK_SIZE) {
-    return reinterpret_cast<uintptr_t>(&stack[addr - LIBLAYER_STACK_BASE]);
-  } else if (addr >= LIBLAYER_MEMORY_BASE &&
-             addr < LIBLAYER_MEMORY_BASE + LIBLAYER_MEMORY_SIZE) {
-    return reinterpret_cast<uintptr_t>(&memory[addr - LIBLAYER_MEMORY_BASE]);
+#ifdef LIBLAYER_FASTMEM
+#define FASTMEM_MAX_SPACES (16) // Address spaces the fault handler knows of
+
+// Reservations of the live states, read by the fault handler
+static std::atomic<uint8_t *> fastmem_spaces[FASTMEM_MAX_SPACES];
+static struct sigaction fastmem_previous_action;
+
+static void fastmem_write_fault(uint64_t addr) {
+  char message[] = "liblayer: guest access 0x00000000 outside mapped memory\n";
+  char *digit = strchr(message, 'x') + 8;
+
+  for (int i = 0; i < 8; i++, addr >>= 4) {
+    *digit-- = "0123456789abcdef"[addr & 0xF];
   }
 
-  return 0;
+  // only async-signal-safe functions from here on
+  (void)!write(STDERR_FILENO, message, sizeof(message) - 1);
 }
 
-void ExecutionState::memory_init() {
-  memset(memory, 0, LIBLAYER_MEMORY_SIZE);
+static void fastmem_fault_handler(int sig, siginfo_t *info, void *context) {
+  const auto host = reinterpret_cast<uintptr_t>(info->si_addr);
+
+  for (auto &space : fastmem_spaces) {
+    const auto base = reinterpret_cast<uintptr_t>(space.load());
 
-  const Block blk = {.allocated = false, .size = BLOCK_SIZE};
-  for (uint32_t i = 0; i < LIBLAYER_MEMORY_SIZE; i += BLOCK_ITER) {
-    // discard whats outside the range
-    if (i + BLOCK_ITER >= LIBLAYER_MEMORY_SIZE) {
+    if (base && host >= base && host < base + LIBLAYER_FASTMEM_SIZE) {
+      fastmem_write_fault(host - base);
       break;
     }
+  }
 
-    memcpy(&memory[i], &blk, sizeof(blk));
+  // host faults (and sanitizers) go to whoever handled them before,
+  // otherwise the default action runs once the access is retried
+  if (fastmem_previous_action.sa_flags & SA_SIGINFO &&
+      fastmem_previous_action.sa_sigaction) {
+    fastmem_previous_action.sa_sigaction(sig, info, context);
+  } else if (fastmem_previous_action.sa_handler != SIG_IGN &&
+             fastmem_previous_action.sa_handler != SIG_DFL) {
+    fastmem_previous_action.sa_handler(sig);
+  } else {
+    signal(sig, SIG_DFL);
   }
 }
-void *ExecutionState::memory_alloc(uint32_t size) {
-  std::cout << "malloc " << size << std::endl;
 
-  if (!size) {
-    return nullptr;
+static void fastmem_install_handler() {
+  // the handler runs on its own stack, so it also reports host stack
+  // overflows caused by deep guest recursion. Alternate stacks are per
+  // thread, each thread that creates a state gets one unless it has its own.
+  static thread_local std::unique_ptr<uint8_t[]> alt_stack;
+  stack_t current = {};
+
+  if (!alt_stack && !sigaltstack(nullptr, &current) &&
+      current.ss_flags & SS_DISABLE) {
+    alt_stack = std::make_unique<uint8_t[]>(1024 * 64);
+
+    stack_t ss = {};
+    ss.ss_sp = alt_stack.get();
+    ss.ss_size = 1024 * 64;
+    sigaltstack(&ss, nullptr);
   }
 
-  size = (size + 3) & ~3; // word-align
+  static std::once_flag once;
 
-  std::lock_guard lock{memory_mutex};
+  std::call_once(once, [] {
+    struct sigaction action = {};
+    action.sa_sigaction = fastmem_fault_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &fastmem_previous_action);
+  });
+}
 
-  // we iterate trying to find a free block
-  uint8_t *ptr = memory;
-  uint8_t *end = memory + LIBLAYER_MEMORY_SIZE;
+void Memory::fastmem_init() {
+  // only reserved, pages become accessible once they are mapped
+  void *p = mmap(nullptr, LIBLAYER_FASTMEM_SIZE, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (p == MAP_FAILED) {
+    liblayer_fault("fastmem: unable to reserve the address space");
+  }
 
-  while (ptr < end) {
-    Block blk;
-    memcpy(&blk, ptr, sizeof(blk));
+  fastmem = static_cast<uint8_t *>(p);
 
-    if (blk.allocated) {
-      ptr += blk.size + sizeof(blk);
-      continue;
+  fastmem_install_handler();
+
+  for (auto &space : fastmem_spaces) {
+    uint8_t *expected = nullptr;
+    if (space.compare_exchange_strong(expected, fastmem)) {
+      return;
     }
+  }
 
-    // check if block is enough in size
-    if (blk.size >= size) {
-      // maybe even too big. calculate the diff
-      int64_t diff = blk.size - size;
+  // faults in an unregistered space would go unreported
+  fastmem_free();
+  liblayer_fault("fastmem: too many address spaces");
+}
 
-      // if its more than block sizes, split the block in two
-      if (diff >= BLOCK_SIZE) {
-        uint8_t *next_blk_ptr = memory + diff + sizeof(Block);
-        const Block next_blk = {.allocated = false,
-                                .size = static_cast<uint32_t>(diff)};
-        memcpy(next_blk_ptr, &next_blk, sizeof(next_blk));
+void Memory::fastmem_free() {
+  for (auto &space : fastmem_spaces) {
+    uint8_t *expected = fastmem;
+    if (space.compare_exchange_strong(expected, nullptr)) {
+      break;
+    }
+  }
 
-        blk.size -= diff;
-      }
+  munmap(fastmem, LIBLAYER_FASTMEM_SIZE);
+  fastmem = nullptr;
+}
 
-      blk.allocated = true;
-      memcpy(ptr, &blk, sizeof(blk));
-      return ptr + sizeof(blk);
+uint8_t *Memory::fastmem_map(uint32_t addr, uint32_t size) {
+  const uint64_t page = sysconf(_SC_PAGESIZE);
+  const uint64_t start = addr & ~(page - 1);
+  const uint64_t end = (static_cast<uint64_t>(addr) + size + page - 1) &
+                       ~(page - 1);
+
+  if (mprotect(fastmem + start, end - start, PROT_READ | PROT_WRITE)) {
+    liblayer_fault("fastmem: unable to map ", addr);
+  }
+
+  return fastmem + addr;
+}
+#endif
+
+void Memory::memory_init() {
+  memset(memory, 0, LIBLAYER_MEMORY_SIZE);
+
+  heap_fl_bitmap = 0;
+  for (uint32_t fl = 0; fl < HEAP_FL_COUNT; fl++) {
+    heap_sl_bitmap[fl] = 0;
+
+    for (uint32_t sl = 0; sl < HEAP_SL_COUNT; sl++) {
+      heap_free[fl][sl] = BLOCK_NONE;
     }
+  }
 
-    // dont give up yet, try to combine multiple blocks
-    uint8_t *next_blk_ptr = memory + blk.size + sizeof(Block);
-    size_t accumulated_size = blk.size, n = 1;
-    bool found = false;
-
-    while (next_blk_ptr < end) {
-      Block next_blk;
-      memcpy(&next_blk, next_blk_ptr, sizeof(next_blk));
-
-      // we hit a taken block
-      if (next_blk.allocated) {
-        next_blk_ptr += next_blk.size + sizeof(Block);
-        accumulated_size = 0;
-        n = 0;
-        continue;
-      }
+  // one free block spanning everything but the end marker
+  const uint32_t end =
+      (LIBLAYER_MEMORY_SIZE & ~(BLOCK_ALIGN - 1)) - BLOCK_HEADER;
+
+  Block *first = block_at(memory, 0);
+  first->prev = BLOCK_NONE;
+  first->size = (end - BLOCK_HEADER) | BLOCK_FREE;
 
-      // hey maybe we reached our target!
-      accumulated_size += next_blk.size;
-      n++;
-      if (accumulated_size >= size) {
-        found = true;
-        break;
+  Block *last = block_at(memory, end);
+  last->prev = 0;
+  last->size = 0;
+
+  heap_insert(0);
+}
+
+// Size class of `size`: rows are powers of two, split in HEAP_SL_COUNT lists
+// each. Sizes below HEAP_SMALL are in row 0, one list per BLOCK_ALIGN.
+void Memory::heap_mapping(uint32_t size, uint32_t &fl, uint32_t &sl) {
+  if (size < HEAP_SMALL) {
+    fl = 0;
+    sl = size / BLOCK_ALIGN;
+  } else {
+    const uint32_t log2 = 31 - __builtin_clz(size);
+    sl = (size >> (log2 - HEAP_SL_LOG2)) - HEAP_SL_COUNT;
+    fl = log2 - HEAP_FL_SHIFT + 1;
+  }
+}
+
+void Memory::heap_insert(uint32_t block) {
+  Block *blk = block_at(memory, block);
+
+  uint32_t fl, sl;
+  heap_mapping(block_size(blk), fl, sl);
+
+  const uint32_t head = heap_free[fl][sl];
+  blk->next_free = head;
+  blk->prev_free = BLOCK_NONE;
+
+  if (head != BLOCK_NONE) {
+    block_at(memory, head)->prev_free = block;
+  }
+
+  heap_free[fl][sl] = block;
+  heap_fl_bitmap |= 1u << fl;
+  heap_sl_bitmap[fl] |= 1u << sl;
+}
+
+void Memory::heap_remove(uint32_t block) {
+  Block *blk = block_at(memory, block);
+
+  uint32_t fl, sl;
+  heap_mapping(block_size(blk), fl, sl);
+
+  if (blk->next_free != BLOCK_NONE) {
+    block_at(memory, blk->next_free)->prev_free = blk->prev_free;
+  }
+
+  if (blk->prev_free != BLOCK_NONE) {
+    block_at(memory, blk->prev_free)->next_free = blk->next_free;
+  } else {
+    heap_free[fl][sl] = blk->next_free;
+
+    if (blk->next_free == BLOCK_NONE) {
+      heap_sl_bitmap[fl] &= ~(1u << sl);
+
+      if (!heap_sl_bitmap[fl]) {
+        heap_fl_bitmap &= ~(1u << fl);
       }
+    }
+  }
+}
+
+// Marks the block free, merges it with free neighbours and puts it in its list
+void Memory::heap_release(uint32_t block) {
+  Block *blk = block_at(memory, block);
+  blk->size |= BLOCK_FREE;
+
+  const uint32_t next = block_next(block, blk);
+  Block *next_blk = block_at(memory, next);
+
+  if (next_blk->size & BLOCK_FREE) {
+    heap_remove(next);
+    blk->size += BLOCK_HEADER + block_size(next_blk);
+    block_at(memory, block_next(block, blk))->prev = block;
+  }
 
-      next_blk_ptr += next_blk.size + sizeof(Block);
+  if (blk->prev != BLOCK_NONE) {
+    const uint32_t prev = blk->prev;
+    Block *prev_blk = block_at(memory, prev);
+
+    if (prev_blk->size & BLOCK_FREE) {
+      heap_remove(prev);
+      prev_blk->size += BLOCK_HEADER + block_size(blk);
+      block_at(memory, block_next(prev, prev_blk))->prev = prev;
+
+      block = prev;
     }
+  }
+
+  heap_insert(block);
+}
+
+// Shrinks a used block to `size`, the rest becomes a free block if it's big
+// enough for one
+void Memory::heap_split(uint32_t block, uint32_t size) {
+  Block *blk = block_at(memory, block);
+  const uint32_t current = block_size(blk);
+
+  if (current - size < BLOCK_HEADER + BLOCK_MIN) {
+    return;
+  }
+
+  const uint32_t rest = block + BLOCK_HEADER + size;
+  Block *rest_blk = block_at(memory, rest);
+  rest_blk->prev = block;
+  rest_blk->size = current - size - BLOCK_HEADER;
+  block_at(memory, block_next(rest, rest_blk))->prev = rest;
+
+  blk->size = size;
+  heap_release(rest);
+}
+
+void *Memory::heap_alloc(uint32_t size) {
+  uint32_t fl, sl;
+
+  // round up to the next size class, so that any block in the list fits
+  if (size >= HEAP_SMALL) {
+    size += (1u << (31 - __builtin_clz(size) - HEAP_SL_LOG2)) - 1;
+  }
+
+  heap_mapping(size, fl, sl);
+
+  // first non-empty list of that class or a bigger one
+  uint32_t sl_map = heap_sl_bitmap[fl] & (~0u << sl);
 
-    if (found) {
-      blk.size = accumulated_size + n * sizeof(Block);
-      blk.allocated = true;
-      memcpy(ptr, &blk, sizeof(blk));
-      return ptr + sizeof(blk);
+  if (!sl_map) {
+    const uint32_t fl_map =
+        fl + 1 < HEAP_FL_COUNT ? heap_fl_bitmap & (~0u << (fl + 1)) : 0;
+
+    if (!fl_map) {
+      return nullptr;
     }
 
-    ptr += blk.size + sizeof(blk);
+    fl = __builtin_ctz(fl_map);
+    sl_map = heap_sl_bitmap[fl];
   }
 
-  return nullptr;
+  sl = __builtin_ctz(sl_map);
+
+  const uint32_t block = heap_free[fl][sl];
+  heap_remove(block);
+
+  Block *blk = block_at(memory, block);
+  blk->size &= ~BLOCK_FREE;
+  return memory + block + BLOCK_HEADER;
+}
+
+// 8-byte aligned like malloc, big enough to hold the free list links once freed
+static inline uint32_t heap_request(uint32_t size) {
+  return size < BLOCK_MIN ? BLOCK_MIN
+                          : (size + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
 }
 
-void ExecutionState::memory_free(void *p) {
+void *Memory::memory_alloc(uint32_t size) {
+  if (!size || size > LIBLAYER_MEMORY_SIZE) {
+    return nullptr;
+  }
+
+  size = heap_request(size);
+
+  std::lock_guard lock{memory_mutex};
+
+  void *p = heap_alloc(size);
+
+  if (p) {
+    heap_split(static_cast<uint8_t *>(p) - memory - BLOCK_HEADER, size);
+  }
+
+  return p;
+}
+
+void *Memory::memory_calloc(uint32_t count, uint32_t size) {
+  const uint64_t total = static_cast<uint64_t>(count) * size;
+
+  if (total > LIBLAYER_MEMORY_SIZE) {
+    return nullptr;
+  }
+
+  void *p = memory_alloc(static_cast<uint32_t>(total));
+
+  if (p) {
+    memset(p, 0, total);
+  }
+
+  return p;
+}
+
+void *Memory::memory_realloc(void *p, uint32_t size) {
   if (!p) {
-    return;
+    return memory_alloc(size);
   }
 
+  if (!size) {
+    memory_free(p);
+    return nullptr;
+  }
+
+  if (size > LIBLAYER_MEMORY_SIZE) {
+    return nullptr;
+  }
+
+  size = heap_request(size);
+
   std::lock_guard lock{memory_mutex};
-  char *base = reinterpret_cast<char *>(p) - sizeof(Block);
 
-  Block blk;
-  memcpy(&blk, base, sizeof(Block));
+  const uint32_t block = static_cast<uint8_t *>(p) - memory - BLOCK_HEADER;
+  Block *blk = block_at(memory, block);
+  const uint32_t current = block_size(blk);
 
-  blk.allocated = false;
-  memcpy(base, &blk, sizeof(Block));
+  // shrink, or grow in place into a free block that follows
+  const uint32_t next = block_next(block, blk);
+  Block *next_blk = block_at(memory, next);
+
+  if (current < size && next_blk->size & BLOCK_FREE &&
+      current + BLOCK_HEADER + block_size(next_blk) >= size) {
+    heap_remove(next);
+    blk->size += BLOCK_HEADER + block_size(next_blk);
+    block_at(memory, block_next(block, blk))->prev = block;
+  }
+
+  if (block_size(blk) >= size) {
+    heap_split(block, size);
+    return p;
+  }
+
+  void *moved = heap_alloc(size);
+
+  if (!moved) {
+    return nullptr;
+  }
+
+  heap_split(static_cast<uint8_t *>(moved) - memory - BLOCK_HEADER, size);
+  memcpy(moved, p, current);
+  heap_release(block);
+  return moved;
+}
+
+void Memory::memory_free(void *p) {
+  if (!p) {
+    return;
+  }
+
+  std::lock_guard lock{memory_mutex};
+  heap_release(static_cast<uint8_t *>(p) - memory - BLOCK_HEADER);
 }